@@ -0,0 +1,122 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "trapi.hpp"
+#include "program.hpp"
+#include "utils.hpp"
+
+#define WIDTH (1280)
+#define HEIGHT (720)
+
+using namespace TGRenderer;
+
+static const char *getBufferMode()
+{
+#if __ATOMIC_BUFFER__
+    return "atomic";
+#elif __NEED_BUFFER_LOCK__
+    return "lock";
+#else
+    return "none";
+#endif
+}
+
+/* Layers of full screen grids at different depth, every thread writes to all of the pixels. */
+static void createOverdrawMesh(TRMeshData &mesh, int layers, int grid)
+{
+    float step = 2.0f / grid;
+    for (int l = 0; l < layers; l++)
+    {
+        // Interleave near and far layers, so half of the fragments pass the depth test.
+        float z = ((l * 7) % layers) / float(layers) * 1.8f - 0.9f;
+        glm::vec3 color(float(l % 3 == 0), float(l % 3 == 1), float(l % 3 == 2));
+        for (int j = 0; j < grid; j++)
+            for (int i = 0; i < grid; i++)
+            {
+                float x0 = -1.0f + i * step, y0 = -1.0f + j * step;
+                float x1 = x0 + step, y1 = y0 + step;
+                glm::vec3 v[6] =
+                {
+                    glm::vec3(x0, y0, z), glm::vec3(x1, y0, z), glm::vec3(x1, y1, z),
+                    glm::vec3(x1, y1, z), glm::vec3(x0, y1, z), glm::vec3(x0, y0, z),
+                };
+                for (int k = 0; k < 6; k++)
+                {
+                    mesh.vertices.push_back(v[k]);
+                    mesh.colors.push_back(color);
+                }
+            }
+    }
+}
+
+static void benchOverdraw(int frames)
+{
+    TRMeshData mesh;
+    createOverdrawMesh(mesh, 32, 16);
+    ColorShader shader;
+
+    truTimerBegin();
+    for (int i = 0; i < frames; i++)
+    {
+        trClear(TR_CLEAR_DEPTH_BIT | TR_CLEAR_COLOR_BIT);
+        trDrawArrays(TR_TRIANGLES, mesh, &shader);
+    }
+    std::cout << "overdraw: buffer mode = " << getBufferMode() << ", "
+        << truTimerGetSecondsFromBegin() * 1000.0 / frames << " ms/frame" << std::endl;
+}
+
+/* A rotating textured sphere filling the screen, the texture is sampled across the rows and the columns. */
+static void benchTexture(int frames, TRTextureLayout layout)
+{
+    TRTexture texture("examples/res/earth.tga", false, layout);
+    if (!texture.OK())
+        return;
+
+    TRMeshData sphere;
+    truCreateSphere(sphere, 40, 40);
+    TextureMapShader shader;
+
+    trSetMat4(glm::lookAt(glm::vec3(0.0f, 0.0f, 1.6f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f)), MAT4_VIEW);
+    trSetMat4(glm::perspective(glm::radians(75.0f), float(WIDTH) / HEIGHT, 0.1f, 100.0f), MAT4_PROJ);
+    trBindTexture(&texture, TEXTURE_DIFFUSE);
+
+    truTimerBegin();
+    for (int i = 0; i < frames; i++)
+    {
+        glm::mat4 model = glm::rotate(glm::mat4(1.0f), glm::radians(7.0f * i), glm::vec3(0.3f, 1.0f, 0.2f));
+        trSetMat4(model, MAT4_MODEL);
+        trClear(TR_CLEAR_DEPTH_BIT | TR_CLEAR_COLOR_BIT);
+        trDrawArrays(TR_TRIANGLES, sphere, &shader);
+    }
+    std::cout << "texture: layout = " << (layout == TEXTURE_LAYOUT_TILED ? "tiled" : "linear") << ", "
+        << truTimerGetSecondsFromBegin() * 1000.0 / frames << " ms/frame" << std::endl;
+
+    trBindTexture(nullptr, TEXTURE_DIFFUSE);
+    trSetMat4(glm::mat4(1.0f), MAT4_MODEL);
+    trSetMat4(glm::mat4(1.0f), MAT4_VIEW);
+    trSetMat4(glm::mat4(1.0f), MAT4_PROJ);
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    int frames = argc > 2 ? atoi(argv[2]) : 20;
+
+    TRBuffer *buffer = trCreateRenderTarget(WIDTH, HEIGHT);
+    trSetRenderThreadNum(threads);
+    trClearColor3f(0.1, 0.1, 0.1);
+
+    benchOverdraw(frames);
+    truSavePNG("bench_overdraw.png", buffer);
+
+    benchTexture(frames, TEXTURE_LAYOUT_LINEAR);
+    benchTexture(frames, TEXTURE_LAYOUT_TILED);
+    truSavePNG("bench_texture.png", buffer);
+
+    delete buffer;
+    return 0;
+}
@@ -24,8 +24,7 @@ class TextureMapExShader : public TextureMapShader
             int frame = *reinterpret_cast<int *>(trGetUniformData());
             glm::vec2 texCoord = fsdata->getVec2(SH_TEXCOORD);
             texCoord.x -= frame * 0.001f;
-            textureCoordWrap(texCoord);
-            float *c = texture2D(TEXTURE_DIFFUSE, texCoord.x, texCoord.y);
+            glm::vec4 c = texture2DGrad(TEXTURE_DIFFUSE, texCoord, fsdata->dFdxVec2(SH_TEXCOORD), fsdata->dFdyVec2(SH_TEXCOORD));
             color[0] = c[0];
             color[1] = c[1];
             color[2] = c[2];
@@ -3,14 +3,32 @@
 
 #include <glm/glm.hpp>
 #include <mutex>
+#include <atomic>
+#include <limits>
+
+/* Lock free buffer: the depth of pixel is swapped with a CAS, no mutex is needed. */
+#ifndef __ATOMIC_BUFFER__
+#define __ATOMIC_BUFFER__ (0)
+#endif
 
 #ifndef __NEED_BUFFER_LOCK__
-#define __NEED_BUFFER_LOCK__ (1)
+#define __NEED_BUFFER_LOCK__ (!__ATOMIC_BUFFER__)
+#endif
+
+#if __NEED_BUFFER_LOCK__ && __ATOMIC_BUFFER__
+#error "Buffer lock and atomic buffer can't be enabled together."
 #endif
 
 namespace TGRenderer
 {
     constexpr int BUFFER_CHANNEL = 4;
+    /* Hierarchical Z: max depth of every 8x8 tile. */
+    constexpr int HIZ_TILE_SHIFT = 3;
+    constexpr int HIZ_TILE_SIZE = 1 << HIZ_TILE_SHIFT;
+    /* Depth of the pixel which is being written in atomic buffer mode, all of the depth tests pass against it. */
+    constexpr float DEPTH_LOCKED = std::numeric_limits<float>::infinity();
+    /* Visibility buffer: draw ID in the high 32 bits, primitive ID in the low 32 bits. */
+    constexpr uint64_t VISIBILITY_NONE = ~uint64_t(0);
     class TRBuffer
     {
         public:
@@ -29,10 +47,30 @@ namespace TGRenderer
             size_t getOffset(int x, int y) const;
             virtual size_t getStride() const;
             virtual void drawPixel(int x, int y, float color[]);
+            /* Depth-only targets return false, the fragment stage is skipped for them. */
+            virtual bool hasColor() const;
             float getDepth(size_t offset) const;
+            const float *getDepthBuffer() const;
             void updateDepth(size_t offset, float depth);
+#if __ATOMIC_BUFFER__
+            /* Wait until no one else is writing the pixel, then swap DEPTH_LOCKED in, return the stored depth. */
+            float lockDepth(size_t offset);
+            /* Store the new depth and release the pixel, color must be written before it. */
+            void unlockDepth(size_t offset, float depth);
+#endif
+            /* Conservative max depth of the tile which pixel (x, y) belongs to. */
+            float getHiZ(int x, int y) const;
+            /* Re-calculate the max depth of the tile which pixel (x, y) belongs to. */
+            void updateHiZ(int x, int y);
+            /* Re-calculate all of the tiles, needed after the depth was written without depth test. */
+            void rebuildHiZ();
             uint8_t getStencil(size_t offset) const;
             void updateStencil(size_t offset, uint8_t stencil);
+            /* Visibility buffer is allocated at the first clear, only the visibility shading mode needs it. */
+            void clearVisibility();
+            const uint64_t *getVisibilityBuffer() const;
+            uint64_t getVisibility(size_t offset) const;
+            void updateVisibility(size_t offset, uint64_t id);
 #if __NEED_BUFFER_LOCK__
             std::mutex & getMutex(size_t offset);
 #endif
@@ -55,7 +93,10 @@ namespace TGRenderer
 
         private:
             float *mDepth = nullptr;
+            float *mHiZ = nullptr;
+            uint32_t mHiZW = 0;
             uint8_t *mStencil = nullptr;
+            uint64_t *mVisibility = nullptr;
 
             int mVX = 0;
             int mVY = 0;
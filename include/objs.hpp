@@ -23,13 +23,6 @@ class TRObj
         ColorPhongShader mColorPhongShader;
         TextureMapPhongShader mTextureMapPhongShader;
         ShadowMapShader mShadowShader;
-        TGRenderer::Shader *mShaders[4] =
-        {
-            &mColorShader,
-            &mTextureMapShader,
-            &mColorPhongShader,
-            &mTextureMapPhongShader
-        };
 
         struct
         {
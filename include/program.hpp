@@ -1,7 +1,10 @@
 #ifndef __TOPGUN_PROGRAM__
 #define __TOPGUN_PROGRAM__
 
+#include <typeinfo>
+
 #include "trapi.hpp"
+#include "shadow.hpp"
 
 enum
 {
@@ -35,8 +38,17 @@ enum
     SH_VEC4_PHONG_MAX,
 };
 
+/* The samplers wrap the coordinates already, see trBindSampler. This one wraps both axes once either is out of
+ * [0, 1], the repeat sampler wraps every axis on its own, so they differ on an axis at exactly 1.0. */
 void textureCoordWrap(glm::vec2 &coord);
-float *texture2D(int type, float u, float v);
+/* Nearest texel of level 0, the sampler is ignored. */
+glm::vec4 texture2D(int type, float u, float v);
+/* Wrap and filter with the bound sampler, dx and dy are the screen space derivatives of texture coordinate,
+ * e.g. FSInData::dFdxVec2. */
+glm::vec4 texture2DGrad(int type, glm::vec2 coord, glm::vec2 dx, glm::vec2 dy);
+/* Lit fraction at coord.xy, coord.z is the depth to compare with. PCF with the bound sampler for depth textures,
+ * the Chebyshev bound for the RG32F moments of TRVarianceShadowMap. */
+float texture2DShadow(int type, glm::vec3 coord);
 
 class PhongUniformData
 {
@@ -47,45 +59,87 @@ class PhongUniformData
         glm::vec3 mLightColor = glm::vec3(1.0f, 1.0f, 1.0f);
         glm::vec3 mLightPosition = glm::vec3(0.0f, 0.0f, 0.0f);
         glm::vec3 mViewLightPosition = glm::vec3(0.0f, 0.0f, 0.0f);
+        /* Cascades of the bound shadow map, MAT4_LIGHT_MVP is the one of cascade 0 then.
+         * nullptr if the shadow map has one light projection. */
+        const TGRenderer::TRCascadedShadowMap *mShadowCascades = nullptr;
 };
 
+/* The built-in shaders have fragmentBatch for their own type only, a subclass overriding fragment is still called,
+ * unless it opts in with hasFragmentBatch and fragmentBatch too. */
 class ColorShader : public TGRenderer::Shader
 {
-    void vertex(TGRenderer::TRMeshData &, TGRenderer::VSOutData *, size_t );
-    bool fragment(TGRenderer::FSInData *, float color[]);
-    void getVaryingNum(size_t &, size_t &, size_t &);
+    public:
+        void vertex(TGRenderer::TRMeshData &, TGRenderer::VSOutData *, size_t);
+        bool fragment(TGRenderer::FSInData *, float color[]);
+        void getVaryingNum(size_t &, size_t &, size_t &);
+        bool hasFragmentBatch() const { return typeid(*this) == typeid(ColorShader); }
+        void fragmentBatch(TGRenderer::TRFragmentPacket *);
+
+        constexpr static size_t VARYING_VEC2_NUM = SH_VEC2_BASE_MAX;
+        constexpr static size_t VARYING_VEC3_NUM = SH_VEC3_BASE_MAX;
+        constexpr static size_t VARYING_VEC4_NUM = SH_VEC4_BASE_MAX;
 };
 
 class TextureMapShader : public TGRenderer::Shader
 {
-    void vertex(TGRenderer::TRMeshData &, TGRenderer::VSOutData *, size_t );
-    bool fragment(TGRenderer::FSInData *, float color[]);
-    void getVaryingNum(size_t &, size_t &, size_t &);
+    public:
+        void vertex(TGRenderer::TRMeshData &, TGRenderer::VSOutData *, size_t);
+        bool fragment(TGRenderer::FSInData *, float color[]);
+        void getVaryingNum(size_t &, size_t &, size_t &);
+        bool hasFragmentBatch() const { return typeid(*this) == typeid(TextureMapShader); }
+        void fragmentBatch(TGRenderer::TRFragmentPacket *);
+
+        constexpr static size_t VARYING_VEC2_NUM = SH_VEC2_BASE_MAX;
+        constexpr static size_t VARYING_VEC3_NUM = SH_VEC3_BASE_MAX;
+        constexpr static size_t VARYING_VEC4_NUM = SH_VEC4_BASE_MAX;
 };
 
 class ColorPhongShader : public TGRenderer::Shader
 {
-    void vertex(TGRenderer::TRMeshData &, TGRenderer::VSOutData *, size_t);
-    bool fragment(TGRenderer::FSInData *, float color[]);
-    void getVaryingNum(size_t &, size_t &, size_t &);
+    public:
+        void vertex(TGRenderer::TRMeshData &, TGRenderer::VSOutData *, size_t);
+        bool fragment(TGRenderer::FSInData *, float color[]);
+        void getVaryingNum(size_t &, size_t &, size_t &);
+        bool hasFragmentBatch() const { return typeid(*this) == typeid(ColorPhongShader); }
+        void fragmentBatch(TGRenderer::TRFragmentPacket *);
+
+        constexpr static size_t VARYING_VEC2_NUM = SH_VEC2_BASE_MAX;
+        constexpr static size_t VARYING_VEC3_NUM = SH_VEC3_PHONG_MAX;
+        constexpr static size_t VARYING_VEC4_NUM = SH_VEC4_PHONG_MAX;
 };
 
 class TextureMapPhongShader : public TGRenderer::Shader
 {
-    void vertex(TGRenderer::TRMeshData &, TGRenderer::VSOutData *, size_t);
-    bool fragment(TGRenderer::FSInData *, float color[]);
-    void getVaryingNum(size_t &, size_t &, size_t &);
+    public:
+        void vertex(TGRenderer::TRMeshData &, TGRenderer::VSOutData *, size_t);
+        bool fragment(TGRenderer::FSInData *, float color[]);
+        void getVaryingNum(size_t &, size_t &, size_t &);
+        bool hasFragmentBatch() const { return typeid(*this) == typeid(TextureMapPhongShader); }
+        void fragmentBatch(TGRenderer::TRFragmentPacket *);
+
+        constexpr static size_t VARYING_VEC2_NUM = SH_VEC2_BASE_MAX;
+        constexpr static size_t VARYING_VEC3_NUM = SH_VEC3_PHONG_MAX;
+        constexpr static size_t VARYING_VEC4_NUM = SH_VEC4_PHONG_MAX;
 };
 
 class ShadowMapShader : public TGRenderer::Shader
 {
-    private:
+    public:
         void vertex(TGRenderer::TRMeshData &, TGRenderer::VSOutData *, size_t);
         bool fragment(TGRenderer::FSInData *, float color[]);
         void getVaryingNum(size_t &, size_t &, size_t &);
+        bool hasFragmentBatch() const { return typeid(*this) == typeid(ShadowMapShader); }
+        void fragmentBatch(TGRenderer::TRFragmentPacket *);
 
-    public:
+        constexpr static size_t VARYING_VEC2_NUM = SH_VEC2_BASE_MAX;
+        constexpr static size_t VARYING_VEC3_NUM = SH_VEC3_BASE_MAX;
+        constexpr static size_t VARYING_VEC4_NUM = SH_VEC4_BASE_MAX;
         constexpr static float BIAS = 0.001f;
         constexpr static float FACTOR = 0.2f;
+        /* Depth bias of the cascades in texels, see TRCascadedShadowMap::getTexelDepth. */
+        constexpr static float CASCADE_BIAS = 2.0f;
+        /* Variance shadow map */
+        constexpr static float MIN_VARIANCE = 0.00001f;
+        constexpr static float LIGHT_BLEEDING = 0.2f;
 };
 #endif
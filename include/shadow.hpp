@@ -0,0 +1,72 @@
+#ifndef __TOPGUN_SHADOW__
+#define __TOPGUN_SHADOW__
+
+#include <functional>
+#include <glm/glm.hpp>
+
+#include "texture.hpp"
+
+namespace TGRenderer
+{
+    /* Cascaded shadow map of a directional light. The view frustum is split by depth, every slice gets an orthographic
+     * light projection fitted to its bounding sphere, and the cascades are drawn side by side into one depth buffer,
+     * cascade i is the i-th square from the left. */
+    class TRCascadedShadowMap
+    {
+        public:
+            constexpr static int CASCADE_MAX = 4;
+            /* Unused texels around every cascade, so the filters never reach the next one. */
+            constexpr static int MARGIN = 4;
+
+            TRCascadedShadowMap(int size, int cascadeNum = 3);
+            TRCascadedShadowMap(const TRCascadedShadowMap &&) = delete;
+            ~TRCascadedShadowMap();
+
+            /* Split [zNear, zFar] of the perspective camera and fit the light projections, the light matrix must be rigid,
+             * e.g. glm::lookAt. lambda blends the logarithmic (1.0) and the uniform (0.0) split, casters up to casterDistance
+             * in front of a slice along the light are drawn into its cascade. The cascades are snapped to the texels, so
+             * they don't shimmer when the camera moves. */
+            void fit(const glm::mat4 &eyeView, float fovy, float aspect, float zNear, float zFar, const glm::mat4 &lightView,
+                    float lambda = 0.75f, float casterDistance = 4.0f);
+            /* Clear the depth and run drawCasters once per cascade with its viewport, view and projection matrices.
+             * The render target is restored at the end. */
+            void draw(const std::function<void()> &drawCasters);
+
+            /* Projection * view of cascade 0, for MAT4_LIGHT_MVP. */
+            const glm::mat4 &getLightMat() const { return mLightMat; }
+            /* Index of the cascade of a view space depth, getCascadeNum() if it is out of the shadow distance. */
+            inline int selectCascade(float depth) const
+            {
+                int i = 0;
+                while (i < mCascadeNum && depth > mSplit[i])
+                    i++;
+                return i;
+            }
+            /* Shadow map coordinate and depth of cascade i = NDC of cascade 0 * scale + offset. */
+            const glm::vec3 &getScale(int i) const { return mScale[i]; }
+            const glm::vec3 &getOffset(int i) const { return mOffset[i]; }
+            /* Depth of one texel of cascade i in the shadow map depth, the depth bias of a 45 degree slope. */
+            float getTexelDepth(int i) const { return mTexelDepth[i]; }
+            int getCascadeNum() const { return mCascadeNum; }
+            /* Far depth of cascade i in view space. */
+            float getSplit(int i) const { return mSplit[i]; }
+
+            TRDepthBuffer *getBuffer();
+            TRTexture *getTexture();
+
+            bool OK() const;
+
+        private:
+            TRDepthBuffer *mBuffer = nullptr;
+            int mSize = 0;
+            int mCascadeNum = 0;
+            glm::mat4 mLightView = glm::mat4(1.0f);
+            glm::mat4 mLightMat = glm::mat4(1.0f);
+            glm::mat4 mProj[CASCADE_MAX];
+            float mSplit[CASCADE_MAX] = {};
+            glm::vec3 mScale[CASCADE_MAX];
+            glm::vec3 mOffset[CASCADE_MAX];
+            float mTexelDepth[CASCADE_MAX] = {};
+    };
+}
+#endif
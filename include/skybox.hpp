@@ -5,18 +5,48 @@
 #include "program.hpp"
 #include "texture.hpp"
 
-class SkyboxShader : public TextureMapShader
+enum
 {
+    SH_SKYBOX_DIRECTION = SH_VEC3_BASE_MAX,
+    SH_VEC3_SKYBOX_MAX,
+};
+
+/* Full screen triangle at the far plane, the direction of the view ray picks the texel of the cube texture. */
+class SkyboxShader : public TGRenderer::Shader
+{
+    public:
+        TGRenderer::TRCubeTexture *mCubeTexture = nullptr;
+        TGRenderer::TRSampler mSampler = TGRenderer::TRSampler(TGRenderer::TEXTURE_WRAP_CLAMP_TO_EDGE);
+
     private:
         void vertex(TGRenderer::TRMeshData &mesh, TGRenderer::VSOutData *vsdata, size_t index)
         {
-            glm::mat4 viewMat = glm::mat4(glm::mat3(trGetMat4(TGRenderer::MAT4_VIEW)));
-            vsdata->tr_Position = trGetMat4(TGRenderer::MAT4_PROJ) * viewMat  * glm::vec4(mesh.vertices[index], 1.0f);
-            vsdata->tr_Position.z = vsdata->tr_Position.w;
-            vsdata->mVaryingVec2[SH_TEXCOORD] = mesh.texcoords[index];
+            glm::mat4 projMat = trGetMat4(TGRenderer::MAT4_PROJ);
+            glm::vec3 position = mesh.vertices[index];
+            vsdata->tr_Position = glm::vec4(position.x, position.y, 1.0f, 1.0f);
+            // Unproject to the view space at z = -1, it is linear in screen space so the interpolation is exact.
+            glm::vec3 viewDirection((position.x + projMat[2][0]) / projMat[0][0], (position.y + projMat[2][1]) / projMat[1][1], -1.0f);
+            vsdata->setVec3(SH_SKYBOX_DIRECTION, glm::transpose(glm::mat3(trGetMat4(TGRenderer::MAT4_VIEW))) * viewDirection);
+        }
+
+        bool fragment(TGRenderer::FSInData *fsdata, float color[])
+        {
+            glm::vec4 c = mCubeTexture->sample(mSampler, fsdata->getVec3(SH_SKYBOX_DIRECTION),
+                    fsdata->dFdxVec3(SH_SKYBOX_DIRECTION), fsdata->dFdyVec3(SH_SKYBOX_DIRECTION));
+            for (int i = 0; i < 3; i++)
+                color[i] = c[i];
+            return true;
+        }
+
+        void getVaryingNum(size_t &v2, size_t &v3, size_t &v4)
+        {
+            v2 = SH_VEC2_BASE_MAX;
+            v3 = SH_VEC3_SKYBOX_MAX;
+            v4 = SH_VEC4_BASE_MAX;
         }
 };
 
+/* Draw it after the opaque objects with TR_LEQUAL, only the pixels at the cleared depth are shaded. */
 class TRSkyBox
 {
     public:
@@ -30,8 +60,8 @@ class TRSkyBox
     private:
         SkyboxShader mShader;
 
-        TGRenderer::TRTexture *mCubeTexture[6];
-        TGRenderer::TRMeshData mCubeData[6];
+        TGRenderer::TRCubeTexture *mCubeTexture = nullptr;
+        TGRenderer::TRMeshData mScreen;
 
         bool mOK = false;
 };
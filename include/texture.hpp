@@ -1,23 +1,115 @@
 #ifndef __TOPGUN_TEXTURE__
 #define __TOPGUN_TEXTURE__
 
+#include <vector>
+#include <string>
+#include <cstdint>
 #include <glm/glm.hpp>
 #include "buffer.hpp"
 
 namespace TGRenderer
 {
+    /* Channels returned by the batched fetch. */
     constexpr int TEXTURE_CHANNEL = 3;
+
+    /* Storage format of the texels, the fetch always returns float RGBA.
+     * The missing channels read as 0 and alpha reads as 1, the same as OpenGL. */
+    enum TRTextureFormat
+    {
+        TEXTURE_FORMAT_RGBA8,
+        TEXTURE_FORMAT_R8,
+        TEXTURE_FORMAT_RG8,
+        TEXTURE_FORMAT_R16F,
+        TEXTURE_FORMAT_R32F,
+        TEXTURE_FORMAT_RG32F,
+        TEXTURE_FORMAT_RGBA32F,
+    };
+
+    /* Memory layout of the texels of every level. The tiled layout stores 4x4 tiles row by row
+     * and the texels inside a tile in Z-order, a tile of RGBA8 is one cache line. */
+    enum TRTextureLayout
+    {
+        TEXTURE_LAYOUT_LINEAR,
+        TEXTURE_LAYOUT_TILED,
+    };
+
+    enum TRTextureWrap
+    {
+        TEXTURE_WRAP_REPEAT,
+        TEXTURE_WRAP_CLAMP_TO_EDGE,
+        TEXTURE_WRAP_CLAMP_TO_BORDER,
+    };
+
+    enum TRTextureFilter
+    {
+        /* Nearest texel of level 0. */
+        TEXTURE_FILTER_NEAREST,
+        /* Bilinear on level 0. */
+        TEXTURE_FILTER_LINEAR,
+        /* Bilinear on the two nearest levels and blend them. */
+        TEXTURE_FILTER_TRILINEAR,
+    };
+
+    /* Sampler state, bound to a texture unit with trBindSampler. */
+    class TRSampler
+    {
+        public:
+            TRSampler(TRTextureWrap wrap = TEXTURE_WRAP_REPEAT, TRTextureFilter filter = TEXTURE_FILTER_TRILINEAR,
+                    glm::vec4 borderColor = glm::vec4(0.0f))
+                : mWrap(wrap), mFilter(filter), mBorderColor(borderColor) {}
+
+            TRTextureWrap mWrap;
+            TRTextureFilter mFilter;
+            glm::vec4 mBorderColor;
+            /* Footprint of the depth comparison is (2 * mPCFRadius + 1)^2 texels with tent weights. */
+            int mPCFRadius = 1;
+    };
+
     class TRTexture
     {
         public:
-            TRTexture(const char *);
+            /* LDR images are kept as RGBA8 and HDR images as RGBA32F.
+             * The 8-bit color channels are decoded as sRGB if srgb is true, otherwise as linear. */
+            TRTexture(const char *, bool srgb = false, TRTextureLayout layout = TEXTURE_LAYOUT_LINEAR);
             // Empty texture
-            TRTexture(int w, int h);
+            TRTexture(int w, int h, TRTextureFormat format = TEXTURE_FORMAT_RGBA32F,
+                    TRTextureLayout layout = TEXTURE_LAYOUT_LINEAR);
+            /* View of linear texels owned by someone else, e.g. the depth plane of TRDepthBuffer. */
+            TRTexture(int w, int h, TRTextureFormat format, void *data);
             TRTexture(const TRTexture &&) = delete;
             ~TRTexture();
 
-            float* getColor(float u, float v);
-            float* getBuffer();
+            /* Nearest texel of level 0. */
+            glm::vec4 getColor(float u, float v);
+            /* Trilinear filtering between the two nearest levels, bilinear on level 0 if lod <= 0. */
+            glm::vec4 getColor(float u, float v, float lod);
+            /* Level of detail from the screen space derivatives of texture coordinate. */
+            float getLod(glm::vec2 dx, glm::vec2 dy) const;
+            /* Fetch num texels at once, the address calculation runs over all of the coordinates together. */
+            void getColors(const float u[], const float v[], int num, float *color[TEXTURE_CHANNEL]);
+            void getColors(const float u[], const float v[], const float lod[], int num, float *color[TEXTURE_CHANNEL]);
+            /* Wrap and filter with the sampler state, lod is only used by the trilinear filter. */
+            glm::vec4 sample(const TRSampler &sampler, float u, float v, float lod);
+            /* Batched version, the coordinates are wrapped together and the 2x2 footprints are fetched together. */
+            void sample(const TRSampler &sampler, const float u[], const float v[], const float lod[], int num, float *color[TEXTURE_CHANNEL]);
+            /* Percentage closer filtering of a depth texture: the lit fraction of the footprint around (u, v),
+             * a texel is lit if ref <= stored depth. Texels out of the texture are lit. */
+            float sampleCompare(const TRSampler &sampler, float u, float v, float ref);
+            void sampleCompare(const TRSampler &sampler, const float u[], const float v[], const float ref[], int num, float lit[]);
+            /* Encode a RGBA color into the texel of level 0. */
+            void setColor(int x, int y, const float color[]);
+            /* Fill level 0 with a RGBA color. */
+            void clear(const float color[]);
+            /* Build the mip chain from level 0 in parallel, textures loaded from file have it already.
+             * The render targets need to call it again after drawing. */
+            void generateMipmaps();
+            int getLevelNum() const;
+            /* Raw texels of level 0, swizzled in the tiled layout. */
+            void* getBuffer();
+            TRTextureFormat getFormat() const;
+            TRTextureLayout getLayout() const;
+            /* Resident bytes of all levels. */
+            size_t getMemorySize() const;
             int getH() const;
             int getW() const;
             float getXStep() const;
@@ -26,17 +118,52 @@ namespace TGRenderer
             bool OK() const;
 
         private:
+            class TRTextureLevel
+            {
+                public:
+                    uint8_t *mData = nullptr;
+                    int mW = 0;
+                    int mH = 0;
+                    /* Bytes of a texel row, or of a tile row in the tiled layout. */
+                    int mPitch = 0;
+            };
+
+            bool allocate(int w, int h, void *data = nullptr);
+            TRTextureLevel makeLevel(uint8_t *data, int w, int h) const;
+            size_t getLevelSize(int w, int h) const;
+            void downsampleLevel(const TRTextureLevel &src, const TRTextureLevel &dst);
+            template <int L> size_t texelOffset(const TRTextureLevel &level, int x, int y) const;
+            template <int F, int L> glm::vec4 nearest(float u, float v) const;
+            template <int F, int L> glm::vec4 bilinear(const TRTextureLevel &level, float u, float v) const;
+            template <int F, int L> glm::vec4 trilinear(float u, float v, float lod) const;
+            template <int F, int L> void nearestBatch(const float u[], const float v[], int num, float *color[TEXTURE_CHANNEL]) const;
+            template <int F, int L> void bilinearBatch(const int level[], const float u[], const float v[], int num, float *color[TEXTURE_CHANNEL]) const;
+            template <int F, int L> void sampleBatch(const TRSampler &sampler, const float u[], const float v[], const float lod[], int num, float *color[TEXTURE_CHANNEL]) const;
+            template <int F, int L> void compareBatch(const TRSampler &sampler, const float u[], const float v[], const float ref[], int num, float lit[]) const;
+            template <int F, int L> void store(int x, int y, const float color[]);
+            template <int F, int L> void downsample(const TRTextureLevel &src, const TRTextureLevel &dst) const;
+
             bool mOK = false;
-            float *mData = nullptr;
+            TRTextureFormat mFormat = TEXTURE_FORMAT_RGBA32F;
+            TRTextureLayout mLayout = TEXTURE_LAYOUT_LINEAR;
+            bool mSRGB = false;
+            /* Decode table of the 8-bit color channels. */
+            const float *mLut = nullptr;
+            uint8_t *mData = nullptr;
+            bool mOwnData = true;
+            int mTexelSize = 0;
             int mPitch = 0;
             int mW = 0;
             int mH = 0;
+            /* Level 0 is mData, the others are in mMipData. */
+            std::vector<TRTextureLevel> mLevels;
+            std::vector<uint8_t> mMipData;
     };
 
     class TRTextureBuffer : public TRBuffer
     {
         public:
-            TRTextureBuffer(int w, int h);
+            TRTextureBuffer(int w, int h, TRTextureFormat format = TEXTURE_FORMAT_RGBA32F);
             TRTextureBuffer(const TRTextureBuffer &&) = delete;
             ~TRTextureBuffer();
 
@@ -48,6 +175,78 @@ namespace TGRenderer
             TRTexture *mTexture = nullptr;
     };
 
+    /* Render target without color, its depth plane is sampleable as a R32F texture.
+     * Drawing into it runs no fragment shader, e.g. the shadow map pass. */
+    class TRDepthBuffer : public TRBuffer
+    {
+        public:
+            TRDepthBuffer(int w, int h);
+            TRDepthBuffer(const TRDepthBuffer &&) = delete;
+            ~TRDepthBuffer();
+
+            void clearColor();
+            void drawPixel(int x, int y, float color[]);
+            bool hasColor() const;
+            TRTexture *getTexture();
+
+        private:
+            TRTexture *mTexture = nullptr;
+    };
+
+    /* Variance shadow map: the first two moments of a depth texture, blurred by a separable box filter.
+     * Shaders test against it with one filtered fetch and the Chebyshev bound instead of PCF. */
+    class TRVarianceShadowMap
+    {
+        public:
+            TRVarianceShadowMap(int w, int h, int radius = 2);
+            TRVarianceShadowMap(const TRVarianceShadowMap &&) = delete;
+            ~TRVarianceShadowMap();
+
+            /* Rebuild the moments from a linear R32F depth texture of the same size, e.g. TRDepthBuffer::getTexture.
+             * Only needed after the shadow map is redrawn. */
+            void update(TRTexture *depth);
+            /* RG32F moments */
+            TRTexture *getTexture();
+
+            bool OK() const;
+
+        private:
+            TRTexture *mMoments = nullptr;
+            /* Result of the horizontal pass */
+            std::vector<float> mTemp;
+            int mRadius = 0;
+    };
+
+    enum TRCubeFace
+    {
+        TEXTURE_CUBE_BOTTOM,
+        TEXTURE_CUBE_TOP,
+        TEXTURE_CUBE_FRONT,
+        TEXTURE_CUBE_BACK,
+        TEXTURE_CUBE_LEFT,
+        TEXTURE_CUBE_RIGHT,
+        TEXTURE_CUBE_FACE_MAX,
+    };
+
+    /* Six faces sampled by direction, in the order of TRCubeFace. Bottom is -y, front is -z and left is -x. */
+    class TRCubeTexture
+    {
+        public:
+            TRCubeTexture(const std::string names[TEXTURE_CUBE_FACE_MAX]);
+            TRCubeTexture(const TRCubeTexture &&) = delete;
+            ~TRCubeTexture();
+
+            /* dx and dy are the screen space derivatives of the direction, the direction needs not be normalized. */
+            glm::vec4 sample(const TRSampler &sampler, glm::vec3 dir, glm::vec3 dx, glm::vec3 dy);
+            TRTexture *getFace(int face);
+
+            bool OK() const;
+
+        private:
+            TRTexture *mFaces[TEXTURE_CUBE_FACE_MAX] = { nullptr };
+            bool mOK = false;
+    };
+
     enum TRTextureType
     {
         TEXTURE_DIFFUSE,
@@ -0,0 +1,41 @@
+#ifndef __TOPGUN_THREADPOOL__
+#define __TOPGUN_THREADPOOL__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace TGRenderer
+{
+    /* Long-lived render workers, the caller thread always works as thread 0. */
+    class TRThreadPool
+    {
+        public:
+            typedef std::function<void(size_t id)> Job;
+
+            TRThreadPool() = default;
+            TRThreadPool(const TRThreadPool &&) = delete;
+            ~TRThreadPool();
+
+            void setThreadNum(size_t num);
+            size_t getThreadNum() const;
+            /* Run job(id) on every thread, id is from 0 to thread num - 1, return after all of them finished. */
+            void run(const Job &job);
+
+        private:
+            void stop();
+            void workerLoop(size_t id, size_t generation);
+
+            std::vector<std::thread> mWorkers;
+            std::mutex mMutex;
+            std::condition_variable mStartCond;
+            std::condition_variable mDoneCond;
+            const Job *mJob = nullptr;
+            size_t mGeneration = 0;
+            size_t mPending = 0;
+            bool mStop = false;
+    };
+}
+#endif
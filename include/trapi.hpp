@@ -24,6 +24,8 @@ namespace TGRenderer
             std::vector<glm::vec3> normals;
             std::vector<glm::vec3> colors;
             std::vector<glm::vec3> tangents;
+            /* Only used by trDrawElements. */
+            std::vector<uint32_t> indices;
 
             TRMeshData() = default;
             TRMeshData(const TRMeshData &&) = delete;
@@ -53,6 +55,27 @@ namespace TGRenderer
         TR_CW,
     };
 
+    enum TRDepthFunc
+    {
+        TR_NEVER,
+        TR_LESS,
+        TR_EQUAL,
+        TR_LEQUAL,
+        TR_GREATER,
+        TR_NOTEQUAL,
+        TR_GEQUAL,
+        TR_ALWAYS,
+    };
+
+    enum TRShadingMode
+    {
+        TR_SHADING_FORWARD,
+        /* Only depth and the IDs of the visible primitives are written. */
+        TR_SHADING_VISIBILITY,
+        /* Same draws in the same order again, only the visible pixels run fragment shader. */
+        TR_SHADING_DEFERRED,
+    };
+
     enum TRClearBit
     {
         TR_CLEAR_COLOR_BIT = 1,
@@ -61,16 +84,59 @@ namespace TGRenderer
     };
 
     constexpr int SHADER_VARYING_NUM_MAX = 16;
+    constexpr int SHADER_VARYING_FLOAT_MAX = SHADER_VARYING_NUM_MAX * (2 + 3 + 4);
     constexpr int THREAD_MAX = 10;
+    /* Draws kept by the vertex reuse, the least recently used one is replaced. */
+    constexpr int VERTEX_REUSE_MAX = 32;
+
+    /* Packed varyings of a shader: all of the vec2, then vec3, then vec4 in one float block. */
+    class TRVaryingLayout
+    {
+        public:
+            void set(size_t v2, size_t v3, size_t v4)
+            {
+                mVec3Offset = v2 * 2;
+                mVec4Offset = mVec3Offset + v3 * 3;
+                mSize = mVec4Offset + v4 * 4;
+            }
+
+            size_t mVec3Offset = 0;
+            size_t mVec4Offset = 0;
+            /* Number of floats. */
+            size_t mSize = 0;
+    };
+
+    /* Plane equations of varying / w over the screen space of a triangle, for the span stepping and the derivatives. */
+    class TRVaryingPlanes
+    {
+        public:
+            float mA[SHADER_VARYING_FLOAT_MAX];
+            float mB[SHADER_VARYING_FLOAT_MAX];
+            float mC[SHADER_VARYING_FLOAT_MAX];
+            /* dA/dx and dA/dy of 1 / w. */
+            float mInvWA = 0.0f;
+            float mInvWB = 0.0f;
+    };
 
     class VSOutData
     {
         public:
             glm::vec4 tr_Position;
 
-            glm::vec2 mVaryingVec2[SHADER_VARYING_NUM_MAX];
-            glm::vec3 mVaryingVec3[SHADER_VARYING_NUM_MAX];
-            glm::vec4 mVaryingVec4[SHADER_VARYING_NUM_MAX];
+            inline glm::vec2 getVec2(int index) const { return *reinterpret_cast<const glm::vec2 *>(&mVarying[index * 2]); }
+            inline glm::vec3 getVec3(int index) const { return *reinterpret_cast<const glm::vec3 *>(&mVarying[mLayout->mVec3Offset + index * 3]); }
+            inline glm::vec4 getVec4(int index) const { return *reinterpret_cast<const glm::vec4 *>(&mVarying[mLayout->mVec4Offset + index * 4]); }
+            inline void setVec2(int index, glm::vec2 v) { *reinterpret_cast<glm::vec2 *>(&mVarying[index * 2]) = v; }
+            inline void setVec3(int index, glm::vec3 v) { *reinterpret_cast<glm::vec3 *>(&mVarying[mLayout->mVec3Offset + index * 3]) = v; }
+            inline void setVec4(int index, glm::vec4 v) { *reinterpret_cast<glm::vec4 *>(&mVarying[mLayout->mVec4Offset + index * 4]) = v; }
+
+        private:
+            const TRVaryingLayout *mLayout = nullptr;
+            /* mLayout->mSize floats, the storage is owned by the program or the vertex batch, so the pools of vertices
+             * are sized by the shader instead of SHADER_VARYING_FLOAT_MAX. */
+            float *mVarying = nullptr;
+
+            friend class Program;
     };
 
     class FSInData
@@ -81,28 +147,57 @@ namespace TGRenderer
                 return tr_PositionPrim[0] + tr_PositionPrim[1] * mUPC + tr_PositionPrim[2] * mVPC;
             }
 
-            /* Fast interpolation funciotn , v'0 = v0, v'1 = v1 - v0, v'2 = v2 - v0 , pre-calculated */
+            /* The varyings are pre-interpolated by the rasterizer, only the perspective divide is left. */
             inline glm::vec2 getVec2(int index) const
             {
-                return mVaryingVec2Prim[index][0] + mVaryingVec2Prim[index][1] * mUPC + mVaryingVec2Prim[index][2] * mVPC;
+                return load<glm::vec2>(index * 2);
             }
 
             inline glm::vec3 getVec3(int index) const
             {
-                return mVaryingVec3Prim[index][0] + mVaryingVec3Prim[index][1] * mUPC + mVaryingVec3Prim[index][2] * mVPC;
+                return load<glm::vec3>(mLayout->mVec3Offset + index * 3);
             }
 
             inline glm::vec4 getVec4(int index) const
             {
-                return mVaryingVec4Prim[index][0] + mVaryingVec4Prim[index][1] * mUPC + mVaryingVec4Prim[index][2] * mVPC;
+                return load<glm::vec4>(mLayout->mVec4Offset + index * 4);
             }
 
+            /* Screen space derivatives of the varyings, 0 for points and lines. */
+            inline glm::vec2 dFdxVec2(int index) const { return derivative<glm::vec2>(index * 2, true); }
+            inline glm::vec2 dFdyVec2(int index) const { return derivative<glm::vec2>(index * 2, false); }
+            inline glm::vec3 dFdxVec3(int index) const { return derivative<glm::vec3>(mLayout->mVec3Offset + index * 3, true); }
+            inline glm::vec3 dFdyVec3(int index) const { return derivative<glm::vec3>(mLayout->mVec3Offset + index * 3, false); }
+            inline glm::vec4 dFdxVec4(int index) const { return derivative<glm::vec4>(mLayout->mVec4Offset + index * 4, true); }
+            inline glm::vec4 dFdyVec4(int index) const { return derivative<glm::vec4>(mLayout->mVec4Offset + index * 4, false); }
+
         private:
+            template <typename T>
+            inline T load(size_t offset) const
+            {
+                return *reinterpret_cast<const T *>(&mVarying[offset]) * mW;
+            }
+
+            /* varying = N * w, N and 1 / w are linear, so d(varying) = (dN - varying * d(1 / w)) * w. */
+            template <typename T>
+            inline T derivative(size_t offset, bool x) const
+            {
+                if (mPlanes == nullptr)
+                    return T(0.0f);
+                const float *d = x ? mPlanes->mA : mPlanes->mB;
+                float dInvW = x ? mPlanes->mInvWA : mPlanes->mInvWB;
+                return (*reinterpret_cast<const T *>(&d[offset]) - load<T>(offset) * dInvW) * mW;
+            }
+
             glm::vec4 tr_PositionPrim[3];
 
-            glm::vec2 mVaryingVec2Prim[SHADER_VARYING_NUM_MAX][3];
-            glm::vec3 mVaryingVec3Prim[SHADER_VARYING_NUM_MAX][3];
-            glm::vec4 mVaryingVec4Prim[SHADER_VARYING_NUM_MAX][3];
+            const TRVaryingLayout *mLayout = nullptr;
+            /* v'0 = v0, v'1 = v1 - v0, v'2 = v2 - v0 , pre-calculated */
+            float mVaryingPrim[3][SHADER_VARYING_FLOAT_MAX];
+            /* Varyings of the pixel in shading. Triangles keep varying / w here, and mW is the interpolated w. */
+            float mVarying[SHADER_VARYING_FLOAT_MAX];
+            float mW = 1.f;
+            const TRVaryingPlanes *mPlanes = nullptr;
 
             float mUPC = 0.f;
             float mVPC = 0.f;
@@ -110,6 +205,75 @@ namespace TGRenderer
             friend class Program;
     };
 
+    /* Fragments of one span in SoA form, lane i of every array is the i-th fragment. */
+    class TRFragmentPacket
+    {
+        public:
+            constexpr static int SIZE = 8;
+
+            /* In: the lanes with a fragment. Out: clear the bits of the discarded lanes. */
+            unsigned mMask = 0;
+            int mX[SIZE] = {};
+            int mY[SIZE] = {};
+            float mDepth[SIZE] = {};
+            /* Perspective-correct barycentrics. */
+            float mUPC[SIZE] = {};
+            float mVPC[SIZE] = {};
+            /* Out: RGBA of every lane, alpha is 1.0f by default. */
+            float mColor[4][SIZE];
+
+            inline glm::vec4 getPosition(int lane) const
+            {
+                return mPositionPrim[0] + mPositionPrim[1] * mUPC[lane] + mPositionPrim[2] * mVPC[lane];
+            }
+
+            /* Component c of the varying, all of the lanes. Unused lanes hold finite stale values. */
+            inline const float *getVec2(int index, int c) const
+            {
+                return mVarying[index * 2 + c];
+            }
+
+            inline const float *getVec3(int index, int c) const
+            {
+                return mVarying[mLayout->mVec3Offset + index * 3 + c];
+            }
+
+            inline const float *getVec4(int index, int c) const
+            {
+                return mVarying[mLayout->mVec4Offset + index * 4 + c];
+            }
+
+            /* Screen space derivatives of component c of the varying for all of the lanes, 0 for points and lines. */
+            inline void dFdxVec2(int index, int c, float out[SIZE]) const { derivative(index * 2 + c, true, out); }
+            inline void dFdyVec2(int index, int c, float out[SIZE]) const { derivative(index * 2 + c, false, out); }
+            inline void dFdxVec3(int index, int c, float out[SIZE]) const { derivative(mLayout->mVec3Offset + index * 3 + c, true, out); }
+            inline void dFdyVec3(int index, int c, float out[SIZE]) const { derivative(mLayout->mVec3Offset + index * 3 + c, false, out); }
+            inline void dFdxVec4(int index, int c, float out[SIZE]) const { derivative(mLayout->mVec4Offset + index * 4 + c, true, out); }
+            inline void dFdyVec4(int index, int c, float out[SIZE]) const { derivative(mLayout->mVec4Offset + index * 4 + c, false, out); }
+
+        private:
+            /* Same as FSInData::derivative. */
+            inline void derivative(size_t offset, bool x, float out[SIZE]) const
+            {
+                float d = 0.0f, dInvW = 0.0f;
+                if (mPlanes != nullptr)
+                {
+                    d = x ? mPlanes->mA[offset] : mPlanes->mB[offset];
+                    dInvW = x ? mPlanes->mInvWA : mPlanes->mInvWB;
+                }
+                for (int i = 0; i < SIZE; i++)
+                    out[i] = (d - mVarying[offset][i] * dInvW) * mW[i];
+            }
+
+            float mW[SIZE] = {};
+            const TRVaryingPlanes *mPlanes = nullptr;
+            const glm::vec4 *mPositionPrim = nullptr;
+            const TRVaryingLayout *mLayout = nullptr;
+            float mVarying[SHADER_VARYING_FLOAT_MAX][SIZE] = {};
+
+            friend class Program;
+    };
+
     class Shader
     {
         public:
@@ -118,6 +282,29 @@ namespace TGRenderer
             virtual void vertex(TRMeshData &mesh, VSOutData *vsdata, size_t index) = 0;
             virtual bool fragment(FSInData *fsdata, float color[]/* Out */) = 0;
             virtual void getVaryingNum(size_t &v2, size_t &v3, size_t &v4) = 0;
+            /* Optional wide fragment shader. The triangles of a shader with hasFragmentBatch are shaded by packets
+             * of up to TRFragmentPacket::SIZE fragments, points and lines still go through fragment.
+             * fragment is not called for those triangles, so return true for the exact type only, like the built-in
+             * shaders do. A subclass overriding fragment then keeps it, and opts in by overriding both. */
+            virtual bool hasFragmentBatch() const { return false; }
+            virtual void fragmentBatch(TRFragmentPacket * /* packet */) {}
+
+            /* getVaryingNum is asked once, the varying number of a shader can't be changed. */
+            const TRVaryingLayout &getVaryingLayout()
+            {
+                if (!mLayoutReady)
+                {
+                    size_t v2, v3, v4;
+                    getVaryingNum(v2, v3, v4);
+                    mLayout.set(v2, v3, v4);
+                    mLayoutReady = true;
+                }
+                return mLayout;
+            }
+
+        private:
+            TRVaryingLayout mLayout;
+            bool mLayoutReady = false;
     };
 
 #if __DEBUG_FINISH_CB__
@@ -133,13 +320,34 @@ namespace TGRenderer
     void trResetMat4(MAT_INDEX_TYPE type);
     // Draw related API
     void trDrawArrays(TRDrawMode mode, TRMeshData &mesh, Shader *shader);
+    /* Draw with mesh.indices, the shared vertices are shaded once if they are still in the post-transform cache. */
+    void trDrawElements(TRDrawMode mode, TRMeshData &mesh, Shader *shader);
     // Core state related API
     void trSetRenderThreadNum(size_t num);
+    /* Sort-middle rendering: primitives are binned into screen tiles, then every tile is rasterized by one thread. */
+    void trEnableBinning(bool enable);
+    /* Shade all of the vertices of a draw in parallel before the primitive assembly, instead of per primitive. */
+    void trEnableVertexBatch(bool enable);
+    /* Keep the results of the batched vertex stage, a draw with the same mesh, shader, matrices, textures and uniform data
+     * reuses them, e.g. the shading pass after depth pre-pass. The mesh and the uniform data must not be changed in place.
+     * Vertex batch is implied. The results live until it is disabled, at most VERTEX_REUSE_MAX draws are kept and the
+     * least recently used one is replaced, so the draws of one pass should not be more than that. */
+    void trEnableVertexReuse(bool enable);
     void trEnableStencilTest(bool enable);
     void trEnableStencilWrite(bool enable);
     void trEnableDepthTest(bool enable);
+    /* Default is TR_LEQUAL. */
+    void trDepthFunc(TRDepthFunc func);
+    void trDepthMask(bool enable);
+    /* Null fragment stage if disabled, the fragment shader is skipped, only depth and stencil are written.
+     * Depth pre-pass: draw without color write, then draw again with TR_EQUAL and depth mask off. */
+    void trEnableColorWrite(bool enable);
     void trPolygonMode(TRPolygonMode mode);
     void trCullFaceMode(TRCullFaceMode mode);
+    /* Visibility buffer, every pixel is shaded exactly once:
+     * TR_SHADING_VISIBILITY, draw the scene, TR_SHADING_DEFERRED, draw the scene again, TR_SHADING_FORWARD.
+     * Fragment shader can't discard pixels in this mode. */
+    void trShadingMode(TRShadingMode mode);
     TRCullFaceMode trGetCullFaceMode();
     // Buffer related API
     TRBuffer *trCreateRenderTarget(int w, int h);
@@ -152,6 +360,9 @@ namespace TGRenderer
     void trBindTexture(TRTexture *texture, int type);
     void trUnbindTextureAll();
     TRTexture *trGetTexture(int type);
+    /* nullptr restores the default sampler, repeat and trilinear. */
+    void trBindSampler(TRSampler *sampler, int type);
+    TRSampler *trGetSampler(int type);
     // Uniform data related API
     void trSetUniformData(void *data);
     void *trGetUniformData();
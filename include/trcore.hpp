@@ -1,28 +1,204 @@
 #ifndef __TOPGUN_CORE__
 #define __TOPGUN_CORE__
 
+#include <vector>
+#include <cassert>
+#include <functional>
 #include "trapi.hpp"
 
+/* Vectorized raster path, picked at runtime by CPUID. */
+#ifndef __ENABLE_SIMD__
+#define __ENABLE_SIMD__ 1
+#endif
+
 namespace TGRenderer
 {
     constexpr int MAX_VSDATA_NUM = 10;
+    /* Post-transform cache of the indexed draws, direct-mapped by vertex index. */
+    constexpr size_t VERTEX_CACHE_SIZE = 128;
+    constexpr size_t VERTEX_CACHE_INVALID = ~size_t(0);
+    /* In binning mode the render target is split into 64x64 tiles, every tile is owned by one thread. */
+    constexpr int TILE_SIZE_SHIFT = 6;
+    constexpr int TILE_SIZE = 1 << TILE_SIZE_SHIFT;
+    /* Triangles are traversed in 8x8 blocks, blocks are accepted or rejected as a whole if possible.
+     * Blocks are the same as the Hi-Z tiles of buffer. */
+    constexpr int BLOCK_SIZE_SHIFT = HIZ_TILE_SHIFT;
+    constexpr int BLOCK_SIZE = 1 << BLOCK_SIZE_SHIFT;
+
+    /* Screen space plane equation, value = A * (x - x0) + B * (y - y0) + C, (x0, y0) is the origin of the triangle setup. */
+    class TRPlane
+    {
+        public:
+            float A = 0.0f;
+            float B = 0.0f;
+            float C = 0.0f;
+
+            inline float at(float dx, float dy) const
+            {
+                return A * dx + B * dy + C;
+            }
+    };
+
+    /* Computed once per triangle, then the raster loop only needs to step the planes. */
+    class TRTriangleSetup
+    {
+        public:
+            glm::vec2 mOrigin;
+            /* Edge functions, the sign is fixed up so inside points are always positive. */
+            TRPlane mEdge[3];
+            /* Only the CW/CCW cull mode accepts the points on the edge. */
+            bool mInclusive = false;
+            /* Window space depth. */
+            TRPlane mDepth;
+            /* Barycentric divided by clip.w, for perspective-correct interpolation. */
+            TRPlane mPC[3];
+    };
+
+    /* Pixels evaluated together by the SIMD raster path, lane i is pixel x + i. */
+    class TRSpan
+    {
+        public:
+            constexpr static int SIZE = 8;
+
+            /* Lanes inside the triangle. */
+            unsigned mCover = 0;
+            /* Covered lanes passed the early depth test. */
+            unsigned mVisible = 0;
+            /* Covered lanes with negative depth. */
+            unsigned mNegative = 0;
+            float mDepth[SIZE];
+            float mUPC[SIZE];
+            float mVPC[SIZE];
+            /* Perspective-correct clip w, 1 / (PC0 + PC1 + PC2). */
+            float mW[SIZE];
+    };
+
+    /* Evaluate num (<= TRSpan::SIZE) pixels from (dx, dy) relative to the setup origin.
+     * depth points to the depth buffer of the first pixel, nullptr if there is no early depth test.
+     * The early depth test rejects the pixels behind the stored depth, only valid for LESS, LEQUAL and EQUAL.
+     * If cover is false, all of the pixels are known to be inside the triangle. */
+    typedef void (*TRSpanFunc)(const TRTriangleSetup &setup, float dx, float dy, int num, const float *depth, bool cover, TRSpan &span);
+    /* Pick the best implementation for the running CPU, nullptr means scalar only. */
+    TRSpanFunc trGetSpanFunc();
+
+    /* Primitive after geometry processing, vertices are indices of the bin vsdata pool. */
+    class TRBinPrim
+    {
+        public:
+            size_t mVertex[3];
+            int mNum = 0;
+            uint64_t mId = VISIBILITY_NONE;
+    };
+
+    /* Clip space outcodes, a primitive is outside of the frustum if all of its vertices are outside of the same plane. */
+    enum TROutcode
+    {
+        OUTCODE_LEFT = 1,
+        OUTCODE_RIGHT = 2,
+        OUTCODE_BOTTOM = 4,
+        OUTCODE_TOP = 8,
+        OUTCODE_FRUSTUM = 15,
+        /* Need to be clipped on W axis. */
+        OUTCODE_W = 16,
+    };
+
+    /* Output of the batched vertex stage, every vertex of the mesh is shaded once before the primitive assembly. */
+    class TRVertexBatch
+    {
+        public:
+            /* Everything the vertex shader may read, the results are reused only if all of them are the same. */
+            TRMeshData *mMesh = nullptr;
+            Shader *mShader = nullptr;
+            size_t mVertexNum = 0;
+            glm::mat4 mMat4[MAT_INDEX_MAX];
+            glm::mat3 mMat3[MAT_INDEX_MAX];
+            TRTexture *mTexture[TEXTURE_INDEX_MAX];
+            void *mUniform = nullptr;
+            /* Draw count of the last use, for the eviction. */
+            size_t mLastUse = 0;
+
+            std::vector<VSOutData> mVSOutData;
+            /* Varyings of mVSOutData, the stride is the size of the varying layout. */
+            std::vector<float> mVarying;
+            /* Clip space position in SoA layout, the outcodes are computed from them. */
+            std::vector<float> mX;
+            std::vector<float> mY;
+            std::vector<float> mW;
+            std::vector<uint8_t> mOutcode;
+    };
+
+    class Program;
+
+    /* Raster stages instantiated for one shader type, see trGetRasterFuncs. */
+    class TRRasterFuncs
+    {
+        public:
+            void (Program::*mPrepare)(VSOutData *vsdata[], int num);
+            bool (Program::*mSpan)(const TRTriangleSetup &setup, int xStart, int xEnd, int y, bool cover);
+            void (Program::*mPixel)(int x, int y, float depth);
+    };
+
+    template <typename ShaderT> const TRRasterFuncs &trGetRasterFuncs();
+    void trDrawPrims(TRDrawMode mode, TRMeshData &mesh, Shader *shader, bool indexed, const TRRasterFuncs &raster);
+    /* Split [0, count) into slices, run job(start, num) for every slice on a pool of the hardware threads,
+     * it doesn't depend on the render thread number. */
+    void trParallelFor(size_t count, const std::function<void(size_t start, size_t num)> &job);
 
     class Program
     {
         public:
-            Program() = default;
+            Program();
             Program(const Program &&) = delete;
 
             void drawPrimsInstranced(TRMeshData &mesh, size_t index, size_t num);
+            /* Binning mode, geometry stage: shade and clip the primitives, then put them into the tile bins. */
+            void binPrimsInstanced(TRMeshData &mesh, size_t index, size_t num);
+            /* Binning mode, raster stage: rasterize the primitives which were binned into tile by geometry program. */
+            void rasterizeTile(Program &geometry, size_t tile);
             void setBuffer(TRBuffer *buffer);
             void setShader(Shader *shader);
+            void enableBinning(bool enable);
+            /* Vertex shader of the vertices in the slice id of the batched vertex stage. */
+            static void shadeVertices(size_t id, TRVertexBatch &batch, TRMeshData &mesh, Shader *shader);
 
         private:
             TRBuffer *mBuffer = nullptr;
             Shader *mShader = nullptr;
             VSOutData mVSOutData[MAX_VSDATA_NUM];
+            VSOutData mVertexCache[VERTEX_CACHE_SIZE];
+            /* Varyings of mVSOutData and mVertexCache, these are scratch so they have the max size. */
+            float mVSOutVarying[MAX_VSDATA_NUM + VERTEX_CACHE_SIZE][SHADER_VARYING_FLOAT_MAX];
+            size_t mVertexCacheTag[VERTEX_CACHE_SIZE];
             FSInData mFSInData;
+            /* Varying / w of the triangle in drawing, stepped along the span into mFSInData.mVarying. */
+            TRVaryingPlanes mVaryingPlanes;
+            /* x of the values in mFSInData.mVarying. */
+            int mVaryingX = 0;
+            /* Fragments waiting for the batched fragment shader. */
+            TRFragmentPacket mPacket;
+            size_t mPacketOffset[TRFragmentPacket::SIZE];
+            int mPacketNum = 0;
             int mAllocIndex = 0;
+            glm::uvec4 mDrawArea;
+            /* ID of the primitive in drawing for the visibility buffer. */
+            uint64_t mVisibilityId = VISIBILITY_NONE;
+
+            /* Per draw states, picked up by setupDraw. */
+            const TRRasterFuncs *mRaster = nullptr;
+            const TRVaryingLayout *mLayout = nullptr;
+            TRSpanFunc mSpanFunc = nullptr;
+            bool mEarlyDepthTest = false;
+            bool mFragmentBatch = false;
+            /* Color write is enabled and the target has color, otherwise the fragment stage is skipped. */
+            bool mColorWrite = true;
+
+            bool mBinning = false;
+            size_t mTileNumX = 0;
+            std::vector<VSOutData> mBinVSOutData;
+            /* Varyings of mBinVSOutData, the stride is the size of the varying layout. */
+            std::vector<float> mBinVarying;
+            std::vector<TRBinPrim> mBinPrims;
+            std::vector<std::vector<size_t>> mBins;
 #if __DEBUG_FINISH_CB__
             bool mDrawSth = false;
 #endif
@@ -32,14 +208,26 @@ namespace TGRenderer
              * Suggest to use pre-allocated mode, just need to reset the index.
              * Otherwise you need to record all the vsdata pointer and free them. */
             void freeShaderData();
+            void resetVertexCache();
+            /* Run vertex shader for the element-th vertex of the draw, prim is the shaded vertices of the same primitive.
+             * Indexed draws look up the post-transform cache first. */
+            VSOutData *shadeVertex(TRMeshData &mesh, size_t element, VSOutData *prim[], int num);
+            /* Batched vertex stage only, true if the primitive of elements [first, first + num) is out of the frustum. */
+            bool isOutside(TRMeshData &mesh, size_t first, int num);
+            void setupDraw();
             void preDraw();
             void postDraw();
             /* Prepare fragment data for interpolation. Put { V0.AAA, V1.AAA - V0.AAA, V2.AAA - V0.AAA } into FSInData. */
-            void prepareFragmentData(VSOutData *vsdata[], int num);
+            template <typename ShaderT> void prepareFragmentData(VSOutData *vsdata[], int num);
+            /* Copy the position and the used varyings only. */
             /* Add a new vertex if needed when clipping on W axis. Formula: new V.AAA = in2.AAA + t * (in1.AAA -in2.AAA) */
             void getIntersectionVertex(VSOutData *in1, VSOutData *in2, VSOutData *outV);
             void clipLineOnWAxis(VSOutData *in1, VSOutData *in2, VSOutData *out[4], size_t &index);
             void clipOnWAxis(VSOutData *in[3], VSOutData *out[4], size_t &index);
+            void resetBins();
+            void binPrim(VSOutData *vsdata[], int num);
+            /* Rasterize the triangle directly, or put it into the bins in binning mode. */
+            void emitTriangle(VSOutData *vsdata[3]);
             void drawPoint(TRMeshData &mesh, size_t index);
             void drawLine(TRMeshData &mesh, size_t index);
             void drawTriangle(TRMeshData &mesh, size_t index);
@@ -47,7 +235,287 @@ namespace TGRenderer
             void rasterizationLine(VSOutData *vsdata[2]);
             void rasterizationWireframe(VSOutData *vsdata[3]);
             void rasterizationTriangle(VSOutData *vsdata[3]);
-            void drawPixel(int x, int y, float depth);
+            /* Rasterize [xStart, xEnd) of row y, return false if the rest of triangle should be skipped.
+             * Coverage test is skipped if cover is false. */
+            template <typename ShaderT> bool rasterizationSpan(const TRTriangleSetup &setup, int xStart, int xEnd, int y, bool cover);
+            void setupTriangle(TRTriangleSetup &setup, glm::vec2 screen[3], glm::vec4 clip[3], glm::vec4 ndc[3], float area);
+            /* Plane equations of varying / w, built from the perspective-correct barycentric planes. */
+            void setupVaryingPlanes(const TRTriangleSetup &setup);
+            /* Evaluate the varying planes at (dx, dy) of row y, then step them to x by dA/dx. */
+            template <typename ShaderT> void startVaryings(float dx, float dy, int x);
+            template <typename ShaderT> void stepVaryings(int x);
+            /* Points and lines: interpolate the varyings of num vertices by mUPC directly. */
+            void interpolateVaryings(int num);
+            template <typename ShaderT> void drawPixel(int x, int y, float depth);
+            /* Batched fragment shader: test the pixel, then put it into the packet, the full packet is shaded. */
+            template <typename ShaderT> void queueFragment(int x, int y, float depth);
+            template <typename ShaderT> void flushPacket();
+            /* Early tests before shading, return false if the pixel is discarded. shading is false if no fragment is needed. */
+            bool testPixel(size_t offset, float depth, bool &shading);
+            /* Take the pixel, resolve it and release it. */
+            void writePixel(int x, int y, size_t offset, float depth, float color[], bool shading);
+            /* Stencil and depth test against the stored depth, then write stencil and color. Return the new depth of pixel.
+             * The caller must own the pixel. */
+            float resolvePixel(int x, int y, size_t offset, float depth, float stored, float color[], bool shading);
+
+            template <typename ShaderT> friend const TRRasterFuncs &trGetRasterFuncs();
     };
+
+    /* Static dispatch for the specialized shader, virtual call for the base one. */
+    template <typename ShaderT>
+    inline bool __fragment__(Shader *shader, FSInData *fsdata, float color[])
+    {
+        return static_cast<ShaderT *>(shader)->ShaderT::fragment(fsdata, color);
+    }
+
+    template <>
+    inline bool __fragment__<Shader>(Shader *shader, FSInData *fsdata, float color[])
+    {
+        return shader->fragment(fsdata, color);
+    }
+
+    template <typename ShaderT>
+    inline void __fragment_batch__(Shader *shader, TRFragmentPacket *packet)
+    {
+        static_cast<ShaderT *>(shader)->ShaderT::fragmentBatch(packet);
+    }
+
+    template <>
+    inline void __fragment_batch__<Shader>(Shader *shader, TRFragmentPacket *packet)
+    {
+        shader->fragmentBatch(packet);
+    }
+
+    /* Specialized shaders have the constexpr varying number, so the copy loops can be unrolled. */
+    template <typename ShaderT>
+    inline size_t __get_varying_size__(const TRVaryingLayout &)
+    {
+        return ShaderT::VARYING_VEC2_NUM * 2 + ShaderT::VARYING_VEC3_NUM * 3 + ShaderT::VARYING_VEC4_NUM * 4;
+    }
+
+    template <>
+    inline size_t __get_varying_size__<Shader>(const TRVaryingLayout &layout)
+    {
+        return layout.mSize;
+    }
+
+    template <typename ShaderT>
+    const TRRasterFuncs &trGetRasterFuncs()
+    {
+        static const TRRasterFuncs funcs =
+        {
+            &Program::prepareFragmentData<ShaderT>,
+            &Program::rasterizationSpan<ShaderT>,
+            &Program::drawPixel<ShaderT>,
+        };
+        return funcs;
+    }
+
+    template <typename ShaderT>
+    void Program::prepareFragmentData(VSOutData *vsdata[], int num)
+    {
+        assert(num > 0 && num < 4);
+        size_t size = __get_varying_size__<ShaderT>(*mLayout);
+        const float *v0 = vsdata[0]->mVarying;
+
+        mFSInData.mLayout = mLayout;
+        mFSInData.tr_PositionPrim[0] = vsdata[0]->tr_Position;
+        for (size_t i = 0; i < size; i++)
+            mFSInData.mVaryingPrim[0][i] = v0[i];
+        for (int n = 1; n < num; n++)
+        {
+            const float *vn = vsdata[n]->mVarying;
+            mFSInData.tr_PositionPrim[n] = vsdata[n]->tr_Position - vsdata[0]->tr_Position;
+            for (size_t i = 0; i < size; i++)
+                mFSInData.mVaryingPrim[n][i] = vn[i] - v0[i];
+        }
+    }
+
+    template <typename ShaderT>
+    inline void Program::startVaryings(float dx, float dy, int x)
+    {
+        size_t size = __get_varying_size__<ShaderT>(*mLayout);
+        for (size_t i = 0; i < size; i++)
+            mFSInData.mVarying[i] = mVaryingPlanes.mA[i] * dx + mVaryingPlanes.mB[i] * dy + mVaryingPlanes.mC[i];
+        mVaryingX = x;
+    }
+
+    template <typename ShaderT>
+    inline void Program::stepVaryings(int x)
+    {
+        size_t size = __get_varying_size__<ShaderT>(*mLayout);
+        int steps = x - mVaryingX;
+        if (steps == 1)
+        {
+            for (size_t i = 0; i < size; i++)
+                mFSInData.mVarying[i] += mVaryingPlanes.mA[i];
+        }
+        else if (steps != 0)
+        {
+            for (size_t i = 0; i < size; i++)
+                mFSInData.mVarying[i] += mVaryingPlanes.mA[i] * steps;
+        }
+        mVaryingX = x;
+    }
+
+    template <typename ShaderT>
+    void Program::drawPixel(int x, int y, float depth)
+    {
+        size_t offset = mBuffer->getOffset(x, y);
+        bool shading = true;
+        if (!testPixel(offset, depth, shading))
+            return;
+
+        float color[4];
+        color[3] = 1.0f;
+        if (shading && !__fragment__<ShaderT>(mShader, &mFSInData, color))
+            return;
+
+        writePixel(x, y, offset, depth, color, shading);
+    }
+
+    template <typename ShaderT>
+    void Program::queueFragment(int x, int y, float depth)
+    {
+        size_t offset = mBuffer->getOffset(x, y);
+        bool shading = true;
+        if (!testPixel(offset, depth, shading))
+            return;
+
+        int lane = mPacketNum++;
+        mPacketOffset[lane] = offset;
+        mPacket.mX[lane] = x;
+        mPacket.mY[lane] = y;
+        mPacket.mDepth[lane] = depth;
+        mPacket.mUPC[lane] = mFSInData.mUPC;
+        mPacket.mVPC[lane] = mFSInData.mVPC;
+        mPacket.mW[lane] = mFSInData.mW;
+        size_t size = __get_varying_size__<ShaderT>(*mLayout);
+        for (size_t i = 0; i < size; i++)
+            mPacket.mVarying[i][lane] = mFSInData.mVarying[i] * mFSInData.mW;
+
+        if (mPacketNum == TRFragmentPacket::SIZE)
+            flushPacket<ShaderT>();
+    }
+
+    template <typename ShaderT>
+    void Program::flushPacket()
+    {
+        if (mPacketNum == 0)
+            return;
+
+        mPacket.mMask = (1u << mPacketNum) - 1;
+        mPacket.mLayout = mLayout;
+        mPacket.mPlanes = mFSInData.mPlanes;
+        mPacket.mPositionPrim = mFSInData.tr_PositionPrim;
+        for (int i = 0; i < TRFragmentPacket::SIZE; i++)
+            mPacket.mColor[3][i] = 1.0f;
+        __fragment_batch__<ShaderT>(mShader, &mPacket);
+
+        for (int i = 0; i < mPacketNum; i++)
+        {
+            if (!(mPacket.mMask & (1u << i)))
+                continue;
+            float color[4] = { mPacket.mColor[0][i], mPacket.mColor[1][i], mPacket.mColor[2][i], mPacket.mColor[3][i] };
+            writePixel(mPacket.mX[i], mPacket.mY[i], mPacketOffset[i], mPacket.mDepth[i], color, true);
+        }
+        mPacketNum = 0;
+    }
+
+    template <typename ShaderT>
+    bool Program::rasterizationSpan(const TRTriangleSetup &setup, int xStart, int xEnd, int y, bool cover)
+    {
+        float dx = xStart - setup.mOrigin.x;
+        float dy = y - setup.mOrigin.y;
+        bool entered = false;
+
+        if (mSpanFunc != nullptr)
+        {
+            const float *depthBuffer = mEarlyDepthTest ? mBuffer->getDepthBuffer() + mBuffer->getOffset(xStart, y) : nullptr;
+            TRSpan span;
+            startVaryings<ShaderT>(dx, dy, xStart);
+            for (int x = xStart; x < xEnd; x += TRSpan::SIZE, dx += TRSpan::SIZE)
+            {
+                mSpanFunc(setup, dx, dy, glm::min(TRSpan::SIZE, xEnd - x), depthBuffer ? depthBuffer + (x - xStart) : nullptr, cover, span);
+                if (!span.mCover)
+                {
+                    /* Triangle is convex, nothing left in this row. */
+                    if (entered)
+                        break;
+                    continue;
+                }
+                entered = true;
+
+                /* z in ndc of opengl should between 0.0f to 1.0f, stop at the first negative one. */
+                unsigned visible = span.mVisible;
+                if (span.mNegative)
+                    visible &= (span.mNegative & (~span.mNegative + 1)) - 1;
+
+                for (int i = 0; visible; i++, visible >>= 1)
+                {
+                    if (!(visible & 1))
+                        continue;
+                    mFSInData.mUPC = span.mUPC[i];
+                    mFSInData.mVPC = span.mVPC[i];
+                    mFSInData.mW = span.mW[i];
+                    stepVaryings<ShaderT>(x + i);
+                    if (mFragmentBatch)
+                        queueFragment<ShaderT>(x + i, y, span.mDepth[i]);
+                    else
+                        drawPixel<ShaderT>(x + i, y, span.mDepth[i]);
+                }
+
+                if (span.mNegative)
+                {
+                    flushPacket<ShaderT>();
+                    return false;
+                }
+            }
+            flushPacket<ShaderT>();
+            return true;
+        }
+
+        /* Scalar path: evaluate the planes at the start of row, then step them by dA/dx. */
+        const TRPlane &e0 = setup.mEdge[0], &e1 = setup.mEdge[1], &e2 = setup.mEdge[2];
+        const TRPlane &pc0 = setup.mPC[0], &pc1 = setup.mPC[1], &pc2 = setup.mPC[2];
+        const TRPlane &z = setup.mDepth;
+        float w0 = e0.at(dx, dy), w1 = e1.at(dx, dy), w2 = e2.at(dx, dy);
+        float p0 = pc0.at(dx, dy), p1 = pc1.at(dx, dy), p2 = pc2.at(dx, dy);
+        float depth = z.at(dx, dy);
+        startVaryings<ShaderT>(dx, dy, xStart);
+
+        for (int x = xStart; x < xEnd; x++,
+                w0 += e0.A, w1 += e1.A, w2 += e2.A,
+                p0 += pc0.A, p1 += pc1.A, p2 += pc2.A, depth += z.A)
+        {
+            bool inside = !cover || (setup.mInclusive ? (w0 >= 0 && w1 >= 0 && w2 >= 0) : (w0 > 0 && w1 > 0 && w2 > 0));
+            if (!inside)
+            {
+                if (entered)
+                    break;
+                continue;
+            }
+            entered = true;
+
+            if (depth < 0.0f)
+            {
+                flushPacket<ShaderT>();
+                return false;
+            }
+
+            /* Perspective-Correct */
+            float areaPC = 1.0f / (p0 + p1 + p2);
+            mFSInData.mUPC = p1 * areaPC;
+            mFSInData.mVPC = p2 * areaPC;
+            mFSInData.mW = areaPC;
+            stepVaryings<ShaderT>(x);
+            if (mFragmentBatch)
+                queueFragment<ShaderT>(x, y, depth);
+            else
+                drawPixel<ShaderT>(x, y, depth);
+        }
+        flushPacket<ShaderT>();
+        return true;
+    }
 }
 #endif
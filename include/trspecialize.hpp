@@ -0,0 +1,54 @@
+#ifndef __TOPGUN_SPECIALIZE__
+#define __TOPGUN_SPECIALIZE__
+
+#include <typeinfo>
+
+#include "trapi.hpp"
+#include "trcore.hpp"
+#include "program.hpp"
+
+/* Compile time shader specialization.
+ * trDrawArrays<ShaderT> runs the raster stages instantiated for ShaderT, the fragment shader is called without
+ * virtual dispatch and the varying copy loops have the constant trip count of ShaderT. ShaderT must be the exact type
+ * of shader, and must have public fragment and constexpr VARYING_VEC2_NUM, VARYING_VEC3_NUM and VARYING_VEC4_NUM.
+ * A subclass of ShaderT is drawn by the virtual path, so its overrides are still called.
+ * The non-template trDrawArrays keeps the virtual path for ad-hoc shaders. */
+namespace TGRenderer
+{
+    /* Disable the template argument deduction, the shader type must be given explicitly. */
+    template <typename T>
+    struct TRIdentity
+    {
+        typedef T type;
+    };
+
+    template <typename ShaderT>
+    inline void trDrawArrays(TRDrawMode mode, TRMeshData &mesh, typename TRIdentity<ShaderT>::type *shader)
+    {
+        if (typeid(*shader) != typeid(ShaderT))
+        {
+            trDrawArrays(mode, mesh, static_cast<Shader *>(shader));
+            return;
+        }
+        trDrawPrims(mode, mesh, shader, false, trGetRasterFuncs<ShaderT>());
+    }
+
+    template <typename ShaderT>
+    inline void trDrawElements(TRDrawMode mode, TRMeshData &mesh, typename TRIdentity<ShaderT>::type *shader)
+    {
+        if (typeid(*shader) != typeid(ShaderT))
+        {
+            trDrawElements(mode, mesh, static_cast<Shader *>(shader));
+            return;
+        }
+        trDrawPrims(mode, mesh, shader, true, trGetRasterFuncs<ShaderT>());
+    }
+
+    /* Built-in shaders are instantiated in program.cpp, where the fragment shaders can be inlined. */
+    extern template const TRRasterFuncs &trGetRasterFuncs<ColorShader>();
+    extern template const TRRasterFuncs &trGetRasterFuncs<TextureMapShader>();
+    extern template const TRRasterFuncs &trGetRasterFuncs<ColorPhongShader>();
+    extern template const TRRasterFuncs &trGetRasterFuncs<TextureMapPhongShader>();
+    extern template const TRRasterFuncs &trGetRasterFuncs<ShadowMapShader>();
+}
+#endif
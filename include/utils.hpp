@@ -24,6 +24,14 @@ bool truLoadObj(
         std::vector<glm::vec2> & out_texcoords,
         std::vector<glm::vec3> & out_normals
         );
+/* Indexed version, the vertices with the same position, uv and normal are merged. */
+bool truLoadObj(
+        const char * path,
+        std::vector<glm::vec3> & out_vertices,
+        std::vector<glm::vec2> & out_texcoords,
+        std::vector<glm::vec3> & out_normals,
+        std::vector<uint32_t> & out_indices
+        );
 void truCreateFloorPlane(TGRenderer::TRMeshData &mesh, float height, float width = 4.0f, const float *color = &WHITE[0]);
 void truCreateQuadPlane(TGRenderer::TRMeshData &mesh);
 void truCreateSphere(TGRenderer::TRMeshData &mesh, int uStepNum, int vStepNum, const float *color = &WHITE[0]);
@@ -69,6 +69,8 @@ namespace TGRenderer
         for (size_t i = 0; i < mW * mH; i++)
             // add 1e-5 for skybox.
             mDepth[i] = 1.0f + 1e-5;
+        for (size_t i = 0; i < mHiZW * ((mH + HIZ_TILE_SIZE - 1) >> HIZ_TILE_SHIFT); i++)
+            mHiZ[i] = 1.0f + 1e-5;
     }
 
     void TRBuffer::clearStencil()
@@ -87,6 +89,11 @@ namespace TGRenderer
         return y * mW + x;
     }
 
+    bool TRBuffer::hasColor() const
+    {
+        return true;
+    }
+
     void TRBuffer::drawPixel(int x, int y, float color[])
     {
         // flip Y here
@@ -100,11 +107,59 @@ namespace TGRenderer
         return mDepth[offset];
     }
 
+    const float *TRBuffer::getDepthBuffer() const
+    {
+        return mDepth;
+    }
+
     void TRBuffer::updateDepth(size_t offset, float depth)
     {
         mDepth[offset] = depth;
     }
 
+#if __ATOMIC_BUFFER__
+    static_assert(sizeof(std::atomic<float>) == sizeof(float), "Depth can't be accessed atomically.");
+
+    float TRBuffer::lockDepth(size_t offset)
+    {
+        std::atomic<float> *depth = reinterpret_cast<std::atomic<float> *>(mDepth + offset);
+        while (true)
+        {
+            float stored = depth->load(std::memory_order_relaxed);
+            if (stored != DEPTH_LOCKED && depth->compare_exchange_weak(stored, DEPTH_LOCKED, std::memory_order_acquire))
+                return stored;
+        }
+    }
+
+    void TRBuffer::unlockDepth(size_t offset, float depth)
+    {
+        reinterpret_cast<std::atomic<float> *>(mDepth + offset)->store(depth, std::memory_order_release);
+    }
+#endif
+
+    float TRBuffer::getHiZ(int x, int y) const
+    {
+        return mHiZ[(y >> HIZ_TILE_SHIFT) * mHiZW + (x >> HIZ_TILE_SHIFT)];
+    }
+
+    void TRBuffer::updateHiZ(int x, int y)
+    {
+        int x0 = x & ~(HIZ_TILE_SIZE - 1), y0 = y & ~(HIZ_TILE_SIZE - 1);
+        int x1 = glm::min(x0 + HIZ_TILE_SIZE, int(mW)), y1 = glm::min(y0 + HIZ_TILE_SIZE, int(mH));
+        float maxDepth = 0.0f;
+        for (int j = y0; j < y1; j++)
+            for (int i = x0; i < x1; i++)
+                maxDepth = glm::max(maxDepth, mDepth[j * mW + i]);
+        mHiZ[(y0 >> HIZ_TILE_SHIFT) * mHiZW + (x0 >> HIZ_TILE_SHIFT)] = maxDepth;
+    }
+
+    void TRBuffer::rebuildHiZ()
+    {
+        for (uint32_t y = 0; y < mH; y += HIZ_TILE_SIZE)
+            for (uint32_t x = 0; x < mW; x += HIZ_TILE_SIZE)
+                updateHiZ(x, y);
+    }
+
     uint8_t TRBuffer::getStencil(size_t offset) const
     {
         return mStencil[offset];
@@ -115,6 +170,29 @@ namespace TGRenderer
         mStencil[offset] = stencil;
     }
 
+    void TRBuffer::clearVisibility()
+    {
+        if (mVisibility == nullptr)
+            mVisibility = new uint64_t[mW * mH];
+        for (size_t i = 0; i < mW * mH; i++)
+            mVisibility[i] = VISIBILITY_NONE;
+    }
+
+    const uint64_t *TRBuffer::getVisibilityBuffer() const
+    {
+        return mVisibility;
+    }
+
+    uint64_t TRBuffer::getVisibility(size_t offset) const
+    {
+        return mVisibility[offset];
+    }
+
+    void TRBuffer::updateVisibility(size_t offset, uint64_t id)
+    {
+        mVisibility[offset] = id;
+    }
+
 #if __NEED_BUFFER_LOCK__
     std::mutex & TRBuffer::getMutex(size_t offset)
     {
@@ -138,8 +216,10 @@ namespace TGRenderer
         if (mAlloc && mData == nullptr)
             return;
         mDepth = new float[w * h];
+        mHiZW = (w + HIZ_TILE_SIZE - 1) >> HIZ_TILE_SHIFT;
+        mHiZ = new float[mHiZW * ((h + HIZ_TILE_SIZE - 1) >> HIZ_TILE_SHIFT)];
         mStencil = new uint8_t[w * h];
-        if (mDepth == nullptr || mStencil == nullptr)
+        if (mDepth == nullptr || mHiZ == nullptr || mStencil == nullptr)
             goto error;
 #if __NEED_BUFFER_LOCK__
         mMutex = new std::mutex[((w * h) >> MUTEX_PIXEL_SHIT) + 1];
@@ -161,6 +241,8 @@ error:
             delete mData;
         if (mDepth)
             delete mDepth;
+        if (mHiZ)
+            delete [] mHiZ;
         if (mStencil)
             delete mStencil;
     }
@@ -174,8 +256,12 @@ error:
             delete mData;
         if (mDepth)
             delete mDepth;
+        if (mHiZ)
+            delete [] mHiZ;
         if (mStencil)
             delete mStencil;
+        if (mVisibility)
+            delete [] mVisibility;
 #if __NEED_BUFFER_LOCK__
         if (mMutex)
             delete [] mMutex;
@@ -187,11 +273,11 @@ error:
         return mOK;
     }
 
-    TRTextureBuffer::TRTextureBuffer(int w, int h) : TRBuffer::TRBuffer(w, h, false)
+    TRTextureBuffer::TRTextureBuffer(int w, int h, TRTextureFormat format) : TRBuffer::TRBuffer(w, h, false)
     {
         if (!mOK)
             return;
-        mTexture = new TRTexture(w, h);
+        mTexture = new TRTexture(w, h, format);
         if (!mTexture || !mTexture->OK())
             mOK = false;
     }
@@ -204,21 +290,50 @@ error:
 
     void TRTextureBuffer::clearColor()
     {
-        float *base = mTexture->getBuffer();
-        for (size_t i = 0; i < mW * mH * TEXTURE_CHANNEL; i += TEXTURE_CHANNEL)
-            for (size_t j = 0; j < TEXTURE_CHANNEL; j++)
-                base[i + j] = mBgColor3f[j];
+        mTexture->clear(mBgColor3f);
     }
 
     void TRTextureBuffer::drawPixel(int x, int y, float color[])
     {
-        float *base = mTexture->getBuffer() + (y * mW + x) * TEXTURE_CHANNEL;
-        for (size_t i = 0; i < TEXTURE_CHANNEL; i++)
-            base[i] = color[i];
+        mTexture->setColor(x, y, color);
     }
 
     TRTexture* TRTextureBuffer::getTexture()
     {
         return mTexture;
     }
+
+    TRDepthBuffer::TRDepthBuffer(int w, int h) : TRBuffer::TRBuffer(w, h, false)
+    {
+        if (!mOK)
+            return;
+        // Only sampled by the shaders, the rasterizer writes the depth plane through TRBuffer.
+        mTexture = new TRTexture(w, h, TEXTURE_FORMAT_R32F, const_cast<float *>(getDepthBuffer()));
+        if (!mTexture || !mTexture->OK())
+            mOK = false;
+    }
+
+    TRDepthBuffer::~TRDepthBuffer()
+    {
+        if (mTexture)
+            delete mTexture;
+    }
+
+    void TRDepthBuffer::clearColor()
+    {
+    }
+
+    void TRDepthBuffer::drawPixel(int, int, float [])
+    {
+    }
+
+    bool TRDepthBuffer::hasColor() const
+    {
+        return false;
+    }
+
+    TRTexture* TRDepthBuffer::getTexture()
+    {
+        return mTexture;
+    }
 }
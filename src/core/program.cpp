@@ -4,6 +4,7 @@
 
 #include "trapi.hpp"
 #include "program.hpp"
+#include "trspecialize.hpp"
 
 using namespace TGRenderer;
 
@@ -25,43 +26,228 @@ void textureCoordWrap(glm::vec2 &coord)
        __texture_coord_repeat__(coord);
 }
 
-float *texture2D(int type, float u, float v)
+glm::vec4 texture2D(int type, float u, float v)
 {
     return trGetTexture(type)->getColor(u, v);
 }
 
-float calcShadowFast(float depth, float x, float y)
+glm::vec4 texture2DGrad(int type, glm::vec2 coord, glm::vec2 dx, glm::vec2 dy)
 {
-    if (x <= 1.0f && x >= 0.0f && y <= 1.0f && y >= 0.0f
-            && (depth > *(texture2D(TEXTURE_SHADOWMAP, x, y)) + ShadowMapShader::BIAS))
-        return ShadowMapShader::FACTOR;
+    TRTexture *texture = trGetTexture(type);
+    return texture->sample(*trGetSampler(type), coord.x, coord.y, texture->getLod(dx, dy));
+}
+
+/* Moments out of the shadow map are lit. */
+static const TRSampler gMomentSampler(TEXTURE_WRAP_CLAMP_TO_BORDER, TEXTURE_FILTER_LINEAR, glm::vec4(1.0f));
+
+/* Upper bound of the lit fraction from the moments, the low tail is cut off to reduce light bleeding. */
+static inline float __chebyshev__(float m1, float m2, float ref)
+{
+    const float minVariance = ShadowMapShader::MIN_VARIANCE, bleeding = ShadowMapShader::LIGHT_BLEEDING;
+    float variance = glm::max(m2 - m1 * m1, minVariance);
+    float d = ref - m1;
+    float p = variance / (variance + d * d);
+    p = glm::clamp((p - bleeding) / (1.0f - bleeding), 0.0f, 1.0f);
+    return ref <= m1 ? 1.0f : p;
+}
+
+float texture2DShadow(int type, glm::vec3 coord)
+{
+    TRTexture *texture = trGetTexture(type);
+    if (texture->getFormat() == TEXTURE_FORMAT_RG32F)
+    {
+        glm::vec4 m = texture->sample(gMomentSampler, coord.x, coord.y, 0.0f);
+        return __chebyshev__(m.x, m.y, coord.z);
+    }
+    return texture->sampleCompare(*trGetSampler(type), coord.x, coord.y, coord.z);
+}
+
+float calcShadowPCF(float depth, float x, float y, float bias = ShadowMapShader::BIAS)
+{
+    float lit = texture2DShadow(TEXTURE_SHADOWMAP, glm::vec3(x, y, depth - bias));
+    return ShadowMapShader::FACTOR + (1.0f - ShadowMapShader::FACTOR) * lit;
+}
+
+/* Shadow of the Phong shaders, the cascade is picked by the view depth if the shadow map has cascades. */
+static float __shadow__(const FSInData *fsdata)
+{
+    const TRCascadedShadowMap *cascades = reinterpret_cast<PhongUniformData *>(trGetUniformData())->mShadowCascades;
+    glm::vec4 lightClipV = fsdata->getVec4(SH_LIGHT_FRAG_POSITION);
+    glm::vec3 coord = glm::vec3(lightClipV / lightClipV.w);
+    float bias = ShadowMapShader::BIAS;
+    if (cascades == nullptr)
+        coord = coord * 0.5f + 0.5f;
     else
-        return 1.0f;
+    {
+        int i = cascades->selectCascade(-fsdata->getVec3(SH_VIEW_FRAG_POSITION).z);
+        // Out of the shadow distance
+        if (i == cascades->getCascadeNum())
+            return 1.0f;
+        coord = coord * cascades->getScale(i) + cascades->getOffset(i);
+        bias = ShadowMapShader::CASCADE_BIAS * cascades->getTexelDepth(i);
+    }
+    return calcShadowPCF(coord.z, coord.x, coord.y, bias);
 }
 
-float calcShadowPCF(float depth, float x, float y)
+/* Wide helpers of the batched fragment shaders, lane i of every array is the i-th fragment of the packet.
+ * Every loop runs over all of the lanes without branch, so the compiler can vectorize them. */
+constexpr int LANES = TRFragmentPacket::SIZE;
+
+/* Derivatives of the texture coordinate: du/dx, dv/dx, du/dy, dv/dy. */
+static void __texcoord_grad_lanes__(const TRFragmentPacket *packet, float grad[4][LANES])
 {
-    TRTexture *st = trGetTexture(TEXTURE_SHADOWMAP);
-    float xstep = st->getXStep();
-    float ystep = st->getYStep();
-    float shadow = 0.f;
+    packet->dFdxVec2(SH_TEXCOORD, 0, grad[0]);
+    packet->dFdxVec2(SH_TEXCOORD, 1, grad[1]);
+    packet->dFdyVec2(SH_TEXCOORD, 0, grad[2]);
+    packet->dFdyVec2(SH_TEXCOORD, 1, grad[3]);
+}
+
+/* texture2DGrad of all of the lanes, the sampler wraps the coordinates. */
+static void __texture2D_lanes__(int type, const float u[], const float v[], const float grad[4][LANES], float out[3][LANES])
+{
+    TRTexture *texture = trGetTexture(type);
+    float w = texture->getW(), h = texture->getH();
+    float lod[LANES];
+    for (int i = 0; i < LANES; i++)
+    {
+        float dx = (grad[0][i] * w) * (grad[0][i] * w) + (grad[1][i] * h) * (grad[1][i] * h);
+        float dy = (grad[2][i] * w) * (grad[2][i] * w) + (grad[3][i] * h) * (grad[3][i] * h);
+        lod[i] = glm::log2(glm::sqrt(glm::max(dx, dy)));
+    }
+    float *color[3] = { out[0], out[1], out[2] };
+    texture->sample(*trGetSampler(type), u, v, lod, LANES, color);
+}
+
+static void __load_vec3_lanes__(const TRFragmentPacket *packet, int index, float out[3][LANES])
+{
+    for (int c = 0; c < 3; c++)
+    {
+        const float *src = packet->getVec3(index, c);
+        for (int i = 0; i < LANES; i++)
+            out[c][i] = src[i];
+    }
+}
+
+static void __normalize_lanes__(float v[3][LANES])
+{
+    for (int i = 0; i < LANES; i++)
+    {
+        float s = glm::inversesqrt(v[0][i] * v[0][i] + v[1][i] * v[1][i] + v[2][i] * v[2][i]);
+        v[0][i] *= s;
+        v[1][i] *= s;
+        v[2][i] *= s;
+    }
+}
+
+static void __dot_lanes__(const float a[3][LANES], const float b[3][LANES], float out[])
+{
+    for (int i = 0; i < LANES; i++)
+        out[i] = a[0][i] * b[0][i] + a[1][i] * b[1][i] + a[2][i] * b[2][i];
+}
+
+/* __shadow__ of all of the lanes. */
+static void __shadow_lanes__(const TRFragmentPacket *packet, float shadow[])
+{
+    const TRCascadedShadowMap *cascades = reinterpret_cast<PhongUniformData *>(trGetUniformData())->mShadowCascades;
+    float scale[3][LANES], offset[3][LANES], bias[LANES], outside[LANES];
+    for (int i = 0; i < LANES; i++)
+    {
+        scale[0][i] = scale[1][i] = scale[2][i] = 0.5f;
+        offset[0][i] = offset[1][i] = offset[2][i] = 0.5f;
+        bias[i] = ShadowMapShader::BIAS;
+        outside[i] = 0.0f;
+    }
+    if (cascades != nullptr)
+    {
+        const float *depth = packet->getVec3(SH_VIEW_FRAG_POSITION, 2);
+        int last = cascades->getCascadeNum() - 1;
+        for (int i = 0; i < LANES; i++)
+        {
+            int c = cascades->selectCascade(-depth[i]);
+            outside[i] = c > last ? 1.0f : 0.0f;
+            c = glm::min(c, last);
+            bias[i] = ShadowMapShader::CASCADE_BIAS * cascades->getTexelDepth(c);
+            for (int j = 0; j < 3; j++)
+            {
+                scale[j][i] = cascades->getScale(c)[j];
+                offset[j][i] = cascades->getOffset(c)[j];
+            }
+        }
+    }
 
-    float texcoords[][3] =
+    float x[LANES], y[LANES], ref[LANES];
+    const float *cx = packet->getVec4(SH_LIGHT_FRAG_POSITION, 0);
+    const float *cy = packet->getVec4(SH_LIGHT_FRAG_POSITION, 1);
+    const float *cz = packet->getVec4(SH_LIGHT_FRAG_POSITION, 2);
+    const float *cw = packet->getVec4(SH_LIGHT_FRAG_POSITION, 3);
+    for (int i = 0; i < LANES; i++)
     {
-        {x - xstep, y - ystep, 1.0f}, {x, y - ystep, 2.0f}, {x + xstep, y - ystep, 1.0f},
-        {x - xstep, y, 2.0f}, {x, y, 4.0f}, {x + xstep, y, 2.0f},
-        {x - xstep, y + ystep, 1.0f}, {x, y + ystep, 2.0f}, {x + xstep, y + ystep, 1.0f},
-    };
-    for (size_t i = 0; i < 9; i++)
-        shadow += calcShadowFast(depth, texcoords[i][0], texcoords[i][1]) * texcoords[i][2];
+        x[i] = (cx[i] / cw[i]) * scale[0][i] + offset[0][i];
+        y[i] = (cy[i] / cw[i]) * scale[1][i] + offset[1][i];
+        ref[i] = (cz[i] / cw[i]) * scale[2][i] + offset[2][i] - bias[i];
+    }
 
-    return shadow / 16.0f;
+    TRTexture *st = trGetTexture(TEXTURE_SHADOWMAP);
+    if (st->getFormat() == TEXTURE_FORMAT_RG32F)
+    {
+        float m[3][LANES], lod[LANES] = { 0.0f };
+        float *color[3] = { m[0], m[1], m[2] };
+        st->sample(gMomentSampler, x, y, lod, LANES, color);
+        for (int i = 0; i < LANES; i++)
+            shadow[i] = __chebyshev__(m[0][i], m[1][i], ref[i]);
+    }
+    else
+        st->sampleCompare(*trGetSampler(TEXTURE_SHADOWMAP), x, y, ref, LANES, shadow);
+    // The lanes out of the shadow distance are lit.
+    for (int i = 0; i < LANES; i++)
+        shadow[i] = glm::max(ShadowMapShader::FACTOR + (1.0f - ShadowMapShader::FACTOR) * shadow[i], outside[i]);
+}
+
+/* Diffuse and specular factors of all of the lanes, same as the Phong shaders. normal is normalized in place. */
+static void __phong_lanes__(float normal[3][LANES], const float lightPosition[3][LANES], const float fragmentPosition[3][LANES],
+        int shininess, float diff[], float spec[])
+{
+    float lightDirection[3][LANES], eyeDirection[3][LANES];
+    __normalize_lanes__(normal);
+    for (int c = 0; c < 3; c++)
+        for (int i = 0; i < LANES; i++)
+        {
+            lightDirection[c][i] = lightPosition[c][i] - fragmentPosition[c][i];
+            eyeDirection[c][i] = -fragmentPosition[c][i];
+        }
+    __normalize_lanes__(lightDirection);
+    __normalize_lanes__(eyeDirection);
+
+    __dot_lanes__(normal, lightDirection, diff);
+    for (int i = 0; i < LANES; i++)
+        diff[i] = glm::max(diff[i], 0.0f);
+
+#if __BLINN_PHONG__
+    float halfwayDirection[3][LANES];
+    for (int c = 0; c < 3; c++)
+        for (int i = 0; i < LANES; i++)
+            halfwayDirection[c][i] = lightDirection[c][i] + eyeDirection[c][i];
+    __normalize_lanes__(halfwayDirection);
+    __dot_lanes__(normal, halfwayDirection, spec);
+    float exponent = shininess * 2;
+#else
+    /* reflect(-L, N) = -L + 2 * dot(N, L) * N */
+    float NdotL[LANES], reflectDirection[3][LANES];
+    __dot_lanes__(normal, lightDirection, NdotL);
+    for (int c = 0; c < 3; c++)
+        for (int i = 0; i < LANES; i++)
+            reflectDirection[c][i] = -lightDirection[c][i] - 2.0f * -NdotL[i] * normal[c][i];
+    __dot_lanes__(eyeDirection, reflectDirection, spec);
+    float exponent = shininess;
+#endif
+    for (int i = 0; i < LANES; i++)
+        spec[i] = glm::pow(glm::max(spec[i], 0.0f), exponent);
 }
 
 void ColorShader::vertex(TRMeshData &mesh, VSOutData *vsdata, size_t index)
 {
     vsdata->tr_Position = trGetMat4(MAT4_MVP) * glm::vec4(mesh.vertices[index], 1.0f);
-    vsdata->mVaryingVec3[SH_COLOR] = mesh.colors[index];
+    vsdata->setVec3(SH_COLOR, mesh.colors[index]);
 }
 
 bool ColorShader::fragment(FSInData *fsdata, float color[])
@@ -73,47 +259,64 @@ bool ColorShader::fragment(FSInData *fsdata, float color[])
     return true;
 }
 
+void ColorShader::fragmentBatch(TRFragmentPacket *packet)
+{
+    for (int c = 0; c < 3; c++)
+    {
+        const float *C = packet->getVec3(SH_COLOR, c);
+        for (int i = 0; i < LANES; i++)
+            packet->mColor[c][i] = C[i];
+    }
+}
+
 void ColorShader::getVaryingNum(size_t &v2, size_t &v3, size_t &v4)
 {
-    v2 = SH_VEC2_BASE_MAX;
-    v3 = SH_VEC3_BASE_MAX;
-    v4 = SH_VEC4_BASE_MAX;
+    v2 = VARYING_VEC2_NUM;
+    v3 = VARYING_VEC3_NUM;
+    v4 = VARYING_VEC4_NUM;
 }
 
 void TextureMapShader::vertex(TRMeshData &mesh, VSOutData *vsdata, size_t index)
 {
     vsdata->tr_Position = trGetMat4(MAT4_MVP) * glm::vec4(mesh.vertices[index], 1.0f);
-    vsdata->mVaryingVec2[SH_TEXCOORD] = mesh.texcoords[index];
+    vsdata->setVec2(SH_TEXCOORD, mesh.texcoords[index]);
 }
 
 bool TextureMapShader::fragment(FSInData *fsdata, float color[])
 {
     glm::vec2 texCoord = fsdata->getVec2(SH_TEXCOORD);
-    textureCoordWrap(texCoord);
 
-    float *C = texture2D(TEXTURE_DIFFUSE, texCoord.x, texCoord.y);
+    glm::vec4 C = texture2DGrad(TEXTURE_DIFFUSE, texCoord, fsdata->dFdxVec2(SH_TEXCOORD), fsdata->dFdyVec2(SH_TEXCOORD));
     for (int i = 0; i < 3; i++)
         color[i] = C[i];
 
     return true;
 }
 
+void TextureMapShader::fragmentBatch(TRFragmentPacket *packet)
+{
+    const float *u = packet->getVec2(SH_TEXCOORD, 0), *v = packet->getVec2(SH_TEXCOORD, 1);
+    float grad[4][LANES];
+    __texcoord_grad_lanes__(packet, grad);
+    __texture2D_lanes__(TEXTURE_DIFFUSE, u, v, grad, packet->mColor);
+}
+
 void TextureMapShader::getVaryingNum(size_t &v2, size_t &v3, size_t &v4)
 {
-    v2 = SH_VEC2_BASE_MAX;
-    v3 = SH_VEC3_BASE_MAX;
-    v4 = SH_VEC4_BASE_MAX;
+    v2 = VARYING_VEC2_NUM;
+    v3 = VARYING_VEC3_NUM;
+    v4 = VARYING_VEC4_NUM;
 }
 
 void ColorPhongShader::vertex(TRMeshData &mesh, VSOutData *vsdata, size_t index)
 {
     vsdata->tr_Position = trGetMat4(MAT4_MVP) * glm::vec4(mesh.vertices[index], 1.0f);
-    vsdata->mVaryingVec3[SH_VIEW_FRAG_POSITION] = trGetMat4(MAT4_MODELVIEW) * glm::vec4(mesh.vertices[index], 1.0f);
-    vsdata->mVaryingVec3[SH_NORMAL] = trGetMat3(MAT3_NORMAL) * mesh.normals[index];
-    vsdata->mVaryingVec3[SH_COLOR] = mesh.colors[index];
+    vsdata->setVec3(SH_VIEW_FRAG_POSITION, trGetMat4(MAT4_MODELVIEW) * glm::vec4(mesh.vertices[index], 1.0f));
+    vsdata->setVec3(SH_NORMAL, trGetMat3(MAT3_NORMAL) * mesh.normals[index]);
+    vsdata->setVec3(SH_COLOR, mesh.colors[index]);
 
     if (trGetTexture(TEXTURE_SHADOWMAP) != nullptr)
-        vsdata->mVaryingVec4[SH_LIGHT_FRAG_POSITION] = trGetMat4(MAT4_LIGHT_MVP) * glm::vec4(mesh.vertices[index], 1.0f);
+        vsdata->setVec4(SH_LIGHT_FRAG_POSITION, trGetMat4(MAT4_LIGHT_MVP) * glm::vec4(mesh.vertices[index], 1.0f));
 }
 
 bool ColorPhongShader::fragment(FSInData *fsdata, float color[])
@@ -141,9 +344,7 @@ bool ColorPhongShader::fragment(FSInData *fsdata, float color[])
 #endif
     if (trGetTexture(TEXTURE_SHADOWMAP) != nullptr)
     {
-        glm::vec4 lightClipV = fsdata->getVec4(SH_LIGHT_FRAG_POSITION);
-        lightClipV = (lightClipV / lightClipV.w) * 0.5f + 0.5f;
-        float shadow = calcShadowPCF(lightClipV.z, lightClipV.x, lightClipV.y);
+        float shadow = __shadow__(fsdata);
         diff *= shadow;
         spec *= shadow;
     }
@@ -154,37 +355,71 @@ bool ColorPhongShader::fragment(FSInData *fsdata, float color[])
     return true;
 }
 
+void ColorPhongShader::fragmentBatch(TRFragmentPacket *packet)
+{
+    PhongUniformData *unidata = reinterpret_cast<PhongUniformData *>(trGetUniformData());
+
+    float fragmentPosition[3][LANES], normal[3][LANES], diffuseColor[3][LANES], lightPosition[3][LANES];
+    __load_vec3_lanes__(packet, SH_VIEW_FRAG_POSITION, fragmentPosition);
+    __load_vec3_lanes__(packet, SH_NORMAL, normal);
+    __load_vec3_lanes__(packet, SH_COLOR, diffuseColor);
+    for (int c = 0; c < 3; c++)
+        for (int i = 0; i < LANES; i++)
+            lightPosition[c][i] = unidata->mViewLightPosition[c];
+
+    float diff[LANES], spec[LANES];
+    __phong_lanes__(normal, lightPosition, fragmentPosition, unidata->mShininess, diff, spec);
+    if (trGetTexture(TEXTURE_SHADOWMAP) != nullptr)
+    {
+        float shadow[LANES];
+        __shadow_lanes__(packet, shadow);
+        for (int i = 0; i < LANES; i++)
+        {
+            diff[i] *= shadow[i];
+            spec[i] *= shadow[i];
+        }
+    }
+
+    for (int c = 0; c < 3; c++)
+        for (int i = 0; i < LANES; i++)
+        {
+            float result = ((unidata->mAmbientStrength + diff[i]) * diffuseColor[c][i]
+                    + spec[i] * unidata->mSpecularStrength) * unidata->mLightColor[c];
+            packet->mColor[c][i] = glm::min(result, 1.f);
+        }
+}
+
 void ColorPhongShader::getVaryingNum(size_t &v2, size_t &v3, size_t &v4)
 {
-    v2 = SH_VEC2_BASE_MAX;
-    v3 = SH_VEC3_PHONG_MAX;
-    v4 = SH_VEC4_PHONG_MAX;
+    v2 = VARYING_VEC2_NUM;
+    v3 = VARYING_VEC3_NUM;
+    v4 = VARYING_VEC4_NUM;
 }
 
 void TextureMapPhongShader::vertex(TRMeshData &mesh, VSOutData *vsdata, size_t index)
 {
     vsdata->tr_Position = trGetMat4(MAT4_MVP) * glm::vec4(mesh.vertices[index], 1.0f);
-    vsdata->mVaryingVec3[SH_VIEW_FRAG_POSITION] = trGetMat4(MAT4_MODELVIEW) * glm::vec4(mesh.vertices[index], 1.0f);
-    vsdata->mVaryingVec3[SH_NORMAL] = trGetMat3(MAT3_NORMAL) * mesh.normals[index];
-    vsdata->mVaryingVec2[SH_TEXCOORD] = mesh.texcoords[index];
+    vsdata->setVec3(SH_VIEW_FRAG_POSITION, trGetMat4(MAT4_MODELVIEW) * glm::vec4(mesh.vertices[index], 1.0f));
+    vsdata->setVec3(SH_NORMAL, trGetMat3(MAT3_NORMAL) * mesh.normals[index]);
+    vsdata->setVec2(SH_TEXCOORD, mesh.texcoords[index]);
 
     PhongUniformData *unidata = reinterpret_cast<PhongUniformData *>(trGetUniformData());
 
     if (trGetTexture(TEXTURE_NORMAL) != nullptr)
     {
-        glm::vec3 N = glm::normalize(vsdata->mVaryingVec3[SH_NORMAL]);
-        glm::vec3 T = glm::normalize(trGetMat3(MAT3_NORMAL) * mesh.tangents[index / 3]);
+        glm::vec3 N = glm::normalize(vsdata->getVec3(SH_NORMAL));
+        glm::vec3 T = glm::normalize(trGetMat3(MAT3_NORMAL) * mesh.tangents[index]);
         T = glm::normalize(T - glm::dot(T, N) * N);
         glm::vec3 B = glm::cross(N, T);
         // Mat3 from view space to tangent space
         glm::mat3 TBN = glm::transpose(glm::mat3(T, B, N));
-        vsdata->mVaryingVec3[SH_TANGENT_FRAG_POSITION] = TBN * vsdata->mVaryingVec3[SH_VIEW_FRAG_POSITION];
+        vsdata->setVec3(SH_TANGENT_FRAG_POSITION, TBN * vsdata->getVec3(SH_VIEW_FRAG_POSITION));
         // Light Position is fixed in view space, but will changed in tangent space
-        vsdata->mVaryingVec3[SH_TANGENT_LIGHT_POSITION] = TBN * unidata->mViewLightPosition;
+        vsdata->setVec3(SH_TANGENT_LIGHT_POSITION, TBN * unidata->mViewLightPosition);
     }
 
     if (trGetTexture(TEXTURE_SHADOWMAP) != nullptr)
-        vsdata->mVaryingVec4[SH_LIGHT_FRAG_POSITION] = trGetMat4(MAT4_LIGHT_MVP) * glm::vec4(mesh.vertices[index], 1.0f);
+        vsdata->setVec4(SH_LIGHT_FRAG_POSITION, trGetMat4(MAT4_LIGHT_MVP) * glm::vec4(mesh.vertices[index], 1.0f));
 }
 
 bool TextureMapPhongShader::fragment(FSInData *fsdata, float color[])
@@ -192,18 +427,19 @@ bool TextureMapPhongShader::fragment(FSInData *fsdata, float color[])
     PhongUniformData *unidata = reinterpret_cast<PhongUniformData *>(trGetUniformData());
 
     glm::vec2 texCoord = fsdata->getVec2(SH_TEXCOORD);
-    textureCoordWrap(texCoord);
+    glm::vec2 dx = fsdata->dFdxVec2(SH_TEXCOORD);
+    glm::vec2 dy = fsdata->dFdyVec2(SH_TEXCOORD);
 
     glm::vec3 fragmentPosition;
     glm::vec3 normal;
     glm::vec3 lightPosition;
 
-    glm::vec3 diffuseColor = glm::make_vec3(texture2D(TEXTURE_DIFFUSE, texCoord.x, texCoord.y));
+    glm::vec3 diffuseColor = glm::vec3(texture2DGrad(TEXTURE_DIFFUSE, texCoord, dx, dy));
 
     if (trGetTexture(TEXTURE_NORMAL) != nullptr)
     {
         fragmentPosition = fsdata->getVec3(SH_TANGENT_FRAG_POSITION);
-        normal = glm::make_vec3(texture2D(TEXTURE_NORMAL, texCoord.x, texCoord.y)) * 2.0f - 1.0f;
+        normal = glm::vec3(texture2DGrad(TEXTURE_NORMAL, texCoord, dx, dy)) * 2.0f - 1.0f;
         lightPosition = fsdata->getVec3(SH_TANGENT_LIGHT_POSITION);
     } else {
         fragmentPosition = fsdata->getVec3(SH_VIEW_FRAG_POSITION);
@@ -228,33 +464,93 @@ bool TextureMapPhongShader::fragment(FSInData *fsdata, float color[])
 #endif
     glm::vec3 specColor(1.0f);
     if (trGetTexture(TEXTURE_SPECULAR) != nullptr)
-        specColor = glm::make_vec3(texture2D(TEXTURE_SPECULAR, texCoord.x, texCoord.y));
+        specColor = glm::vec3(texture2DGrad(TEXTURE_SPECULAR, texCoord, dx, dy));
     else
         specColor *= unidata->mSpecularStrength;
 
     if (trGetTexture(TEXTURE_SHADOWMAP) != nullptr)
     {
-        glm::vec4 lightClipV = fsdata->getVec4(SH_LIGHT_FRAG_POSITION);
-        lightClipV = (lightClipV / lightClipV.w) * 0.5f + 0.5f;
-        float shadow = calcShadowPCF(lightClipV.z, lightClipV.x, lightClipV.y);
+        float shadow = __shadow__(fsdata);
         diff *= shadow;
         spec *= shadow;
     }
 
     glm::vec3 result = ((unidata->mAmbientStrength + diff) * diffuseColor + spec * specColor) * unidata->mLightColor;
     if (trGetTexture(TEXTURE_GLOW) != nullptr)
-        result += glm::make_vec3(texture2D(TEXTURE_GLOW, texCoord.x, texCoord.y));
+        result += glm::vec3(texture2DGrad(TEXTURE_GLOW, texCoord, dx, dy));
     for (int i = 0; i < 3; i++)
         color[i] = glm::min(result[i], 1.f);
 
     return true;
 }
 
+void TextureMapPhongShader::fragmentBatch(TRFragmentPacket *packet)
+{
+    PhongUniformData *unidata = reinterpret_cast<PhongUniformData *>(trGetUniformData());
+
+    const float *u = packet->getVec2(SH_TEXCOORD, 0), *v = packet->getVec2(SH_TEXCOORD, 1);
+    float grad[4][LANES];
+    __texcoord_grad_lanes__(packet, grad);
+
+    float fragmentPosition[3][LANES], normal[3][LANES], lightPosition[3][LANES], diffuseColor[3][LANES];
+    __texture2D_lanes__(TEXTURE_DIFFUSE, u, v, grad, diffuseColor);
+
+    if (trGetTexture(TEXTURE_NORMAL) != nullptr)
+    {
+        __load_vec3_lanes__(packet, SH_TANGENT_FRAG_POSITION, fragmentPosition);
+        __texture2D_lanes__(TEXTURE_NORMAL, u, v, grad, normal);
+        for (int c = 0; c < 3; c++)
+            for (int i = 0; i < LANES; i++)
+                normal[c][i] = normal[c][i] * 2.0f - 1.0f;
+        __load_vec3_lanes__(packet, SH_TANGENT_LIGHT_POSITION, lightPosition);
+    } else {
+        __load_vec3_lanes__(packet, SH_VIEW_FRAG_POSITION, fragmentPosition);
+        __load_vec3_lanes__(packet, SH_NORMAL, normal);
+        for (int c = 0; c < 3; c++)
+            for (int i = 0; i < LANES; i++)
+                lightPosition[c][i] = unidata->mViewLightPosition[c];
+    }
+
+    float diff[LANES], spec[LANES];
+    __phong_lanes__(normal, lightPosition, fragmentPosition, unidata->mShininess, diff, spec);
+
+    float specColor[3][LANES];
+    if (trGetTexture(TEXTURE_SPECULAR) != nullptr)
+        __texture2D_lanes__(TEXTURE_SPECULAR, u, v, grad, specColor);
+    else
+        for (int c = 0; c < 3; c++)
+            for (int i = 0; i < LANES; i++)
+                specColor[c][i] = unidata->mSpecularStrength;
+
+    if (trGetTexture(TEXTURE_SHADOWMAP) != nullptr)
+    {
+        float shadow[LANES];
+        __shadow_lanes__(packet, shadow);
+        for (int i = 0; i < LANES; i++)
+        {
+            diff[i] *= shadow[i];
+            spec[i] *= shadow[i];
+        }
+    }
+
+    float glow[3][LANES] = {};
+    if (trGetTexture(TEXTURE_GLOW) != nullptr)
+        __texture2D_lanes__(TEXTURE_GLOW, u, v, grad, glow);
+
+    for (int c = 0; c < 3; c++)
+        for (int i = 0; i < LANES; i++)
+        {
+            float result = ((unidata->mAmbientStrength + diff[i]) * diffuseColor[c][i] + spec[i] * specColor[c][i])
+                * unidata->mLightColor[c] + glow[c][i];
+            packet->mColor[c][i] = glm::min(result, 1.f);
+        }
+}
+
 void TextureMapPhongShader::getVaryingNum(size_t &v2, size_t &v3, size_t &v4)
 {
-    v2 = SH_VEC2_BASE_MAX;
-    v3 = SH_VEC3_PHONG_MAX;
-    v4 = SH_VEC4_PHONG_MAX;
+    v2 = VARYING_VEC2_NUM;
+    v3 = VARYING_VEC3_NUM;
+    v4 = VARYING_VEC4_NUM;
 }
 
 void ShadowMapShader::vertex(TRMeshData &mesh, VSOutData *vsdata, size_t index)
@@ -272,9 +568,29 @@ bool ShadowMapShader::fragment(FSInData *fsdata, float color[])
     return true;
 }
 
+void ShadowMapShader::fragmentBatch(TRFragmentPacket *packet)
+{
+    for (int i = 0; i < LANES; i++)
+    {
+        glm::vec4 clipV = packet->getPosition(i);
+        float depth = glm::clamp((clipV.z / clipV.w) * 0.5f + 0.5f, 0.0f, 1.0f);
+        for (int c = 0; c < 3; c++)
+            packet->mColor[c][i] = depth;
+    }
+}
+
 void ShadowMapShader::getVaryingNum(size_t &v2, size_t &v3, size_t &v4)
 {
-    v2 = SH_VEC2_BASE_MAX;
-    v3 = SH_VEC3_BASE_MAX;
-    v4 = SH_VEC4_BASE_MAX;
+    v2 = VARYING_VEC2_NUM;
+    v3 = VARYING_VEC3_NUM;
+    v4 = VARYING_VEC4_NUM;
+}
+
+namespace TGRenderer
+{
+    template const TRRasterFuncs &trGetRasterFuncs<ColorShader>();
+    template const TRRasterFuncs &trGetRasterFuncs<TextureMapShader>();
+    template const TRRasterFuncs &trGetRasterFuncs<ColorPhongShader>();
+    template const TRRasterFuncs &trGetRasterFuncs<TextureMapPhongShader>();
+    template const TRRasterFuncs &trGetRasterFuncs<ShadowMapShader>();
 }
@@ -0,0 +1,95 @@
+#include <cmath>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "trapi.hpp"
+#include "shadow.hpp"
+
+namespace TGRenderer
+{
+    TRCascadedShadowMap::TRCascadedShadowMap(int size, int cascadeNum)
+    {
+        mSize = size;
+        mCascadeNum = glm::clamp(cascadeNum, 1, CASCADE_MAX);
+        mBuffer = new TRDepthBuffer(size * mCascadeNum, size);
+    }
+
+    TRCascadedShadowMap::~TRCascadedShadowMap()
+    {
+        if (mBuffer)
+            delete mBuffer;
+    }
+
+    void TRCascadedShadowMap::fit(const glm::mat4 &eyeView, float fovy, float aspect, float zNear, float zFar,
+            const glm::mat4 &lightView, float lambda, float casterDistance)
+    {
+        glm::mat4 invEyeView = glm::inverse(eyeView);
+        float tanY = glm::tan(fovy * 0.5f), tanX = tanY * aspect;
+        float k2 = tanX * tanX + tanY * tanY;
+        float splitNear = zNear;
+
+        mLightView = lightView;
+        for (int i = 0; i < mCascadeNum; i++)
+        {
+            float p = float(i + 1) / mCascadeNum;
+            float splitFar = lambda * zNear * std::pow(zFar / zNear, p) + (1.0f - lambda) * (zNear + (zFar - zNear) * p);
+            mSplit[i] = splitFar;
+
+            // The bounding sphere of the slice is centered on the view axis, its radius doesn't change with the camera.
+            float center = glm::min((splitNear + splitFar) * (1.0f + k2) * 0.5f, splitFar);
+            float radius = glm::sqrt(glm::max(splitNear * splitNear * k2 + (center - splitNear) * (center - splitNear),
+                        splitFar * splitFar * k2 + (splitFar - center) * (splitFar - center)));
+            splitNear = splitFar;
+
+            // The sphere covers the cascade except the margin.
+            float texel = 2.0f * radius / (mSize - 2 * MARGIN);
+            float half = texel * mSize * 0.5f;
+            glm::vec4 c = lightView * invEyeView * glm::vec4(0.0f, 0.0f, -center, 1.0f);
+            // Move the cascade by whole texels only.
+            c.x = glm::floor(c.x / texel) * texel;
+            c.y = glm::floor(c.y / texel) * texel;
+            mProj[i] = glm::ortho(c.x - half, c.x + half, c.y - half, c.y + half, -c.z - radius - casterDistance, -c.z + radius);
+            mTexelDepth[i] = texel / (2.0f * radius + casterDistance);
+        }
+
+        // The light view is shared, so NDC of cascade i is NDC of cascade 0 scaled and moved, then mapped into the atlas.
+        mLightMat = mProj[0] * lightView;
+        glm::mat4 invProj0 = glm::inverse(mProj[0]);
+        for (int i = 0; i < mCascadeNum; i++)
+        {
+            glm::mat4 m = mProj[i] * invProj0;
+            mScale[i] = glm::vec3(m[0][0] * 0.5f / mCascadeNum, m[1][1] * 0.5f, m[2][2] * 0.5f);
+            mOffset[i] = glm::vec3((m[3][0] * 0.5f + 0.5f + i) / mCascadeNum, m[3][1] * 0.5f + 0.5f, m[3][2] * 0.5f + 0.5f);
+        }
+    }
+
+    void TRCascadedShadowMap::draw(const std::function<void()> &drawCasters)
+    {
+        TRBuffer *target = trGetRenderTarget();
+        trSetRenderTarget(mBuffer);
+        trClear(TR_CLEAR_DEPTH_BIT);
+        trSetMat4(mLightView, MAT4_VIEW);
+        // Every draw of a cascade is split between the render threads, the viewport keeps it inside its square.
+        for (int i = 0; i < mCascadeNum; i++)
+        {
+            trViewport(i * mSize, 0, mSize, mSize);
+            trSetMat4(mProj[i], MAT4_PROJ);
+            drawCasters();
+        }
+        trSetRenderTarget(target);
+    }
+
+    TRDepthBuffer *TRCascadedShadowMap::getBuffer()
+    {
+        return mBuffer;
+    }
+
+    TRTexture *TRCascadedShadowMap::getTexture()
+    {
+        return mBuffer->getTexture();
+    }
+
+    bool TRCascadedShadowMap::OK() const
+    {
+        return mBuffer && mBuffer->OK() && mBuffer->getTexture()->OK();
+    }
+}
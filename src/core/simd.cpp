@@ -0,0 +1,133 @@
+#include "trcore.hpp"
+
+#if __ENABLE_SIMD__ && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define __X86_SIMD__ 1
+#include <immintrin.h>
+#else
+#define __X86_SIMD__ 0
+#endif
+
+namespace TGRenderer
+{
+#if __X86_SIMD__
+    /* AVX2: 8 pixels in one register. */
+    __attribute__((target("avx2")))
+    static inline __m256 __plane_avx2__(const TRPlane &p, __m256 dx, float dy)
+    {
+        return _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(p.A), dx), _mm256_set1_ps(p.B * dy + p.C));
+    }
+
+    __attribute__((target("avx2")))
+    static void __span_avx2__(const TRTriangleSetup &setup, float dx, float dy, int num, const float *depth, bool cover, TRSpan &span)
+    {
+        const __m256 zero = _mm256_setzero_ps();
+        __m256 x = _mm256_add_ps(_mm256_set1_ps(dx), _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f));
+        unsigned valid = (1u << num) - 1;
+        span.mCover = valid;
+        if (cover)
+        {
+            __m256 w0 = __plane_avx2__(setup.mEdge[0], x, dy);
+            __m256 w1 = __plane_avx2__(setup.mEdge[1], x, dy);
+            __m256 w2 = __plane_avx2__(setup.mEdge[2], x, dy);
+            __m256 inside;
+            if (setup.mInclusive)
+                inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(w0, zero, _CMP_GE_OQ), _mm256_cmp_ps(w1, zero, _CMP_GE_OQ)), _mm256_cmp_ps(w2, zero, _CMP_GE_OQ));
+            else
+                inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(w0, zero, _CMP_GT_OQ), _mm256_cmp_ps(w1, zero, _CMP_GT_OQ)), _mm256_cmp_ps(w2, zero, _CMP_GT_OQ));
+            span.mCover &= _mm256_movemask_ps(inside);
+            if (!span.mCover)
+                return;
+        }
+
+        __m256 z = __plane_avx2__(setup.mDepth, x, dy);
+        span.mNegative = _mm256_movemask_ps(_mm256_cmp_ps(z, zero, _CMP_LT_OQ)) & span.mCover;
+        span.mVisible = span.mCover;
+        if (depth)
+        {
+            // Same as the early-z in drawPixel: reject if the stored depth is less.
+            __m256 stored = _mm256_maskload_ps(depth, _mm256_cmpgt_epi32(_mm256_set1_epi32(num), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+            span.mVisible &= ~_mm256_movemask_ps(_mm256_cmp_ps(stored, z, _CMP_LT_OQ));
+        }
+        if (!span.mVisible)
+            return;
+
+        __m256 p0 = __plane_avx2__(setup.mPC[0], x, dy);
+        __m256 p1 = __plane_avx2__(setup.mPC[1], x, dy);
+        __m256 p2 = __plane_avx2__(setup.mPC[2], x, dy);
+        __m256 areaPC = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(_mm256_add_ps(p0, p1), p2));
+        _mm256_storeu_ps(span.mDepth, z);
+        _mm256_storeu_ps(span.mUPC, _mm256_mul_ps(p1, areaPC));
+        _mm256_storeu_ps(span.mVPC, _mm256_mul_ps(p2, areaPC));
+        _mm256_storeu_ps(span.mW, areaPC);
+    }
+
+    /* SSE4.1: 4 pixels in one register, two passes for one span. */
+    __attribute__((target("sse4.1")))
+    static inline __m128 __plane_sse41__(const TRPlane &p, __m128 dx, float dy)
+    {
+        return _mm_add_ps(_mm_mul_ps(_mm_set1_ps(p.A), dx), _mm_set1_ps(p.B * dy + p.C));
+    }
+
+    __attribute__((target("sse4.1")))
+    static void __span_sse41__(const TRTriangleSetup &setup, float dx, float dy, int num, const float *depth, bool cover, TRSpan &span)
+    {
+        const __m128 zero = _mm_setzero_ps();
+        span.mCover = span.mVisible = span.mNegative = 0;
+
+        for (int half = 0; half < TRSpan::SIZE && half < num; half += 4)
+        {
+            __m128 x = _mm_add_ps(_mm_set1_ps(dx + half), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+            int count = glm::min(num - half, 4);
+            unsigned inside = (1u << count) - 1;
+            if (cover)
+            {
+                __m128 w0 = __plane_sse41__(setup.mEdge[0], x, dy);
+                __m128 w1 = __plane_sse41__(setup.mEdge[1], x, dy);
+                __m128 w2 = __plane_sse41__(setup.mEdge[2], x, dy);
+                if (setup.mInclusive)
+                    inside &= _mm_movemask_ps(_mm_and_ps(_mm_and_ps(_mm_cmpge_ps(w0, zero), _mm_cmpge_ps(w1, zero)), _mm_cmpge_ps(w2, zero)));
+                else
+                    inside &= _mm_movemask_ps(_mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(w0, zero), _mm_cmpgt_ps(w1, zero)), _mm_cmpgt_ps(w2, zero)));
+                if (!inside)
+                    continue;
+            }
+
+            __m128 z = __plane_sse41__(setup.mDepth, x, dy);
+            unsigned visible = inside;
+            span.mNegative |= (_mm_movemask_ps(_mm_cmplt_ps(z, zero)) & inside) << half;
+            if (depth)
+            {
+                float stored[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                for (int i = 0; i < count; i++)
+                    stored[i] = depth[half + i];
+                visible &= ~_mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(stored), z));
+            }
+            span.mCover |= inside << half;
+            span.mVisible |= visible << half;
+            if (!visible)
+                continue;
+
+            __m128 p0 = __plane_sse41__(setup.mPC[0], x, dy);
+            __m128 p1 = __plane_sse41__(setup.mPC[1], x, dy);
+            __m128 p2 = __plane_sse41__(setup.mPC[2], x, dy);
+            __m128 areaPC = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(_mm_add_ps(p0, p1), p2));
+            _mm_storeu_ps(span.mDepth + half, z);
+            _mm_storeu_ps(span.mUPC + half, _mm_mul_ps(p1, areaPC));
+            _mm_storeu_ps(span.mVPC + half, _mm_mul_ps(p2, areaPC));
+            _mm_storeu_ps(span.mW + half, areaPC);
+        }
+    }
+#endif
+
+    TRSpanFunc trGetSpanFunc()
+    {
+#if __X86_SIMD__
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return __span_avx2__;
+        if (__builtin_cpu_supports("sse4.1"))
+            return __span_sse41__;
+#endif
+        return nullptr;
+    }
+}
@@ -1,77 +1,26 @@
 #include "trapi.hpp"
 #include "texture.hpp"
 #include "skybox.hpp"
-#include "utils.hpp"
 
 using namespace TGRenderer;
 
-static constexpr float cube[] =
-{
-    // bottom
-    -1.0, -1.0, -1.0,   0.0, 1.0,
-    -1.0, -1.0, 1.0,    0.0, 0.0,
-    1.0, -1.0, 1.0,     1.0, 0.0,
-    1.0, -1.0, 1.0,     1.0, 0.0,
-    1.0, -1.0, -1.0,    1.0, 1.0,
-    -1.0, -1.0, -1.0,   0.0, 1.0,
-    // top
-    -1.0, 1.0, -1.0,   0.0, 0.0,
-    1.0, 1.0, 1.0,     1.0, 1.0,
-    -1.0, 1.0, 1.0,    0.0, 1.0,
-    1.0, 1.0, 1.0,     1.0, 1.0,
-    -1.0, 1.0, -1.0,   0.0, 0.0,
-    1.0, 1.0, -1.0,    1.0, 0.0,
-    // front
-    -1.0, 1.0, -1.0,    0.0, 1.0,
-    -1.0, -1.0, -1.0,   0.0, 0.0,
-    1.0, -1.0, -1.0,    1.0, 0.0,
-    1.0, -1.0, -1.0,    1.0, 0.0,
-    1.0, 1.0, -1.0,     1.0, 1.0,
-    -1.0, 1.0, -1.0,    0.0, 1.0,
-    // back
-    -1.0, 1.0, 1.0,    1.0, 1.0,
-    1.0, -1.0, 1.0,    0.0, 0.0,
-    -1.0, -1.0, 1.0,   1.0, 0.0,
-    1.0, -1.0, 1.0,    0.0, 0.0,
-    -1.0, 1.0, 1.0,    1.0, 1.0,
-    1.0, 1.0, 1.0,     0.0, 1.0,
-    // left
-    -1.0, 1.0, 1.0,     0.0, 1.0,
-    -1.0, -1.0, 1.0,    0.0, 0.0,
-    -1.0, -1.0, -1.0,   1.0, 0.0,
-    -1.0, -1.0, -1.0,   1.0, 0.0,
-    -1.0, 1.0, -1.0,    1.0, 1.0,
-    -1.0, 1.0, 1.0,     0.0, 1.0,
-    // right
-    1.0, 1.0, 1.0,      1.0, 1.0,
-    1.0, -1.0, -1.0,    0.0, 0.0,
-    1.0, -1.0, 1.0,     1.0, 0.0,
-    1.0, -1.0, -1.0,    0.0, 0.0,
-    1.0, 1.0, 1.0,      1.0, 1.0,
-    1.0, 1.0, -1.0,     0.0, 1.0,
-};
-
 TRSkyBox::TRSkyBox(std::string cubeTextureNames[6])
 {
-    for (size_t i = 0; i < 6; i++)
-        mCubeTexture[i] = nullptr;
+    // One triangle covers the whole screen, its edges are off screen so no pixel falls on them.
+    glm::vec3 corners[3] = { glm::vec3(-2.0f, -2.0f, 0.0f), glm::vec3(4.0f, -2.0f, 0.0f), glm::vec3(-2.0f, 4.0f, 0.0f) };
+    mScreen.vertices.assign(corners, corners + 3);
 
-    for (size_t i = 0; i < 6; i++)
-    {
-        truLoadVec3(cube, i * 6, 6, 0, 5, mCubeData[i].vertices);
-        truLoadVec2(cube, i * 6, 6, 3, 5, mCubeData[i].texcoords);
-        mCubeTexture[i] = new TRTexture(cubeTextureNames[i].c_str());
-        if (!mCubeTexture[i]->OK())
-            return;
-    }
+    mCubeTexture = new TRCubeTexture(cubeTextureNames);
+    if (!mCubeTexture->OK())
+        return;
+    mShader.mCubeTexture = mCubeTexture;
     mOK = true;
 }
 
 TRSkyBox::~TRSkyBox()
 {
-    for (size_t i = 0; i < 6; i++)
-        if (mCubeTexture[i])
-            delete mCubeTexture[i];
+    if (mCubeTexture)
+        delete mCubeTexture;
 }
 
 void TRSkyBox::draw()
@@ -80,12 +29,8 @@ void TRSkyBox::draw()
         return;
 
     TRCullFaceMode oldCullFaceMode = trGetCullFaceMode();
-    trCullFaceMode(TR_CCW);
-    for (size_t i = 0; i < 6; i++)
-    {
-        trBindTexture(mCubeTexture[i], TEXTURE_DIFFUSE);
-        trDrawArrays(TR_TRIANGLES, mCubeData[i], &mShader);
-    }
+    trCullFaceMode(TR_NONE);
+    trDrawArrays(TR_TRIANGLES, mScreen, &mShader);
     trCullFaceMode(oldCullFaceMode);
 }
 
@@ -1,78 +1,790 @@
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
 #include "texture.hpp"
+#include "trcore.hpp"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 namespace TGRenderer
 {
-    TRTexture::TRTexture(const char *name)
+    static int __texel_size__(TRTextureFormat format)
+    {
+        switch (format)
+        {
+            case TEXTURE_FORMAT_RGBA8: return 4;
+            case TEXTURE_FORMAT_R8: return 1;
+            case TEXTURE_FORMAT_RG8: return 2;
+            case TEXTURE_FORMAT_R16F: return 2;
+            case TEXTURE_FORMAT_R32F: return 4;
+            case TEXTURE_FORMAT_RG32F: return 8;
+            case TEXTURE_FORMAT_RGBA32F: return 16;
+        }
+        return 0;
+    }
+
+    static float __srgb_to_linear__(float c)
+    {
+        return c <= 0.04045f ? c / 12.92f : glm::pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+
+    static float __linear_to_srgb__(float c)
+    {
+        return c <= 0.0031308f ? c * 12.92f : 1.055f * glm::pow(c, 1.0f / 2.4f) - 0.055f;
+    }
+
+    /* 8-bit to float decode tables, index 0 is linear and index 1 is sRGB. */
+    static const float *__decode_lut__(bool srgb)
+    {
+        static struct TRDecodeLut
+        {
+            float mTable[2][256];
+            TRDecodeLut()
+            {
+                for (int i = 0; i < 256; i++)
+                {
+                    mTable[0][i] = i / 255.0f;
+                    mTable[1][i] = __srgb_to_linear__(i / 255.0f);
+                }
+            }
+        } lut;
+        return lut.mTable[srgb ? 1 : 0];
+    }
+
+    static uint8_t __encode_unorm8__(float c, bool srgb)
+    {
+        c = glm::clamp(c, 0.0f, 1.0f);
+        if (srgb)
+            c = __linear_to_srgb__(c);
+        return uint8_t(c * 255.0f + 0.5f);
+    }
+
+    static float __half_to_float__(uint16_t h)
+    {
+        uint32_t sign = uint32_t(h & 0x8000) << 16;
+        uint32_t exp = (h >> 10) & 0x1f;
+        uint32_t mant = h & 0x3ff;
+        uint32_t bits;
+        if (exp == 0)
+        {
+            // Zero and denormal
+            float f = mant * (1.0f / 16777216.0f);
+            return sign ? -f : f;
+        }
+        else if (exp == 31)
+            bits = sign | 0x7f800000 | (mant << 13);
+        else
+            bits = sign | ((exp + 112) << 23) | (mant << 13);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+    static uint16_t __float_to_half__(float f)
+    {
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        uint16_t sign = (bits >> 16) & 0x8000;
+        int exp = int((bits >> 23) & 0xff) - 127 + 15;
+        uint32_t mant = bits & 0x7fffff;
+        if (((bits >> 23) & 0xff) == 0xff)
+            return sign | 0x7c00 | (mant ? 0x200 : 0);
+        if (exp >= 31)
+            return sign | 0x7c00;
+        if (exp <= 0)
+        {
+            if (exp < -10)
+                return sign;
+            mant |= 0x800000;
+            int shift = 14 - exp;
+            uint16_t h = uint16_t(mant >> shift);
+            if ((mant >> (shift - 1)) & 1)
+                h++;
+            return sign | h;
+        }
+        // Round to nearest, the carry goes into the exponent correctly.
+        uint16_t h = sign | uint16_t(exp << 10) | uint16_t(mant >> 13);
+        if (mant & 0x1000)
+            h++;
+        return h;
+    }
+
+    /* Format specialized texel decode and encode. */
+    template <int F> static inline glm::vec4 __fetch__(const uint8_t *texel, const float *lut);
+    template <int F> static inline void __store__(uint8_t *texel, const float color[], bool srgb);
+
+    template <> inline glm::vec4 __fetch__<TEXTURE_FORMAT_RGBA8>(const uint8_t *texel, const float *lut)
+    {
+        return glm::vec4(lut[texel[0]], lut[texel[1]], lut[texel[2]], texel[3] * (1.0f / 255.0f));
+    }
+
+    template <> inline glm::vec4 __fetch__<TEXTURE_FORMAT_R8>(const uint8_t *texel, const float *lut)
+    {
+        return glm::vec4(lut[texel[0]], 0.0f, 0.0f, 1.0f);
+    }
+
+    template <> inline glm::vec4 __fetch__<TEXTURE_FORMAT_RG8>(const uint8_t *texel, const float *lut)
+    {
+        return glm::vec4(lut[texel[0]], lut[texel[1]], 0.0f, 1.0f);
+    }
+
+    template <> inline glm::vec4 __fetch__<TEXTURE_FORMAT_R16F>(const uint8_t *texel, const float *)
+    {
+        uint16_t h;
+        memcpy(&h, texel, sizeof(h));
+        return glm::vec4(__half_to_float__(h), 0.0f, 0.0f, 1.0f);
+    }
+
+    template <> inline glm::vec4 __fetch__<TEXTURE_FORMAT_R32F>(const uint8_t *texel, const float *)
+    {
+        float r;
+        memcpy(&r, texel, sizeof(r));
+        return glm::vec4(r, 0.0f, 0.0f, 1.0f);
+    }
+
+    template <> inline glm::vec4 __fetch__<TEXTURE_FORMAT_RG32F>(const uint8_t *texel, const float *)
+    {
+        float c[2];
+        memcpy(c, texel, sizeof(c));
+        return glm::vec4(c[0], c[1], 0.0f, 1.0f);
+    }
+
+    template <> inline glm::vec4 __fetch__<TEXTURE_FORMAT_RGBA32F>(const uint8_t *texel, const float *)
+    {
+        float c[4];
+        memcpy(c, texel, sizeof(c));
+        return glm::vec4(c[0], c[1], c[2], c[3]);
+    }
+
+    template <> inline void __store__<TEXTURE_FORMAT_RGBA8>(uint8_t *texel, const float color[], bool srgb)
+    {
+        for (int i = 0; i < 3; i++)
+            texel[i] = __encode_unorm8__(color[i], srgb);
+        texel[3] = __encode_unorm8__(color[3], false);
+    }
+
+    template <> inline void __store__<TEXTURE_FORMAT_R8>(uint8_t *texel, const float color[], bool srgb)
+    {
+        texel[0] = __encode_unorm8__(color[0], srgb);
+    }
+
+    template <> inline void __store__<TEXTURE_FORMAT_RG8>(uint8_t *texel, const float color[], bool srgb)
+    {
+        texel[0] = __encode_unorm8__(color[0], srgb);
+        texel[1] = __encode_unorm8__(color[1], srgb);
+    }
+
+    template <> inline void __store__<TEXTURE_FORMAT_R16F>(uint8_t *texel, const float color[], bool)
+    {
+        uint16_t h = __float_to_half__(color[0]);
+        memcpy(texel, &h, sizeof(h));
+    }
+
+    template <> inline void __store__<TEXTURE_FORMAT_R32F>(uint8_t *texel, const float color[], bool)
+    {
+        memcpy(texel, color, sizeof(float));
+    }
+
+    template <> inline void __store__<TEXTURE_FORMAT_RG32F>(uint8_t *texel, const float color[], bool)
+    {
+        memcpy(texel, color, sizeof(float) * 2);
+    }
+
+    template <> inline void __store__<TEXTURE_FORMAT_RGBA32F>(uint8_t *texel, const float color[], bool)
+    {
+        memcpy(texel, color, sizeof(float) * 4);
+    }
+
+    /* Tiles are 4x4 texels. */
+    constexpr int TEXTURE_TILE_SHIFT = 2;
+    constexpr int TEXTURE_TILE_SIZE = 1 << TEXTURE_TILE_SHIFT;
+    constexpr int TEXTURE_TILE_MASK = TEXTURE_TILE_SIZE - 1;
+
+    /* Interleave the bits of the coordinates inside a tile. */
+    static inline int __morton_tile__(int x, int y)
+    {
+        return (x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2);
+    }
+
+    /* NaN safe clamp to [0, 1], the unused lanes of a batch may hold anything. */
+    static inline float __saturate__(float c)
+    {
+        c = c >= 0.0f ? c : 0.0f;
+        return c <= 1.0f ? c : 1.0f;
+    }
+
+    template <int W> static inline float __wrap_coord__(float c);
+
+    /* Every axis is wrapped on its own. textureCoordWrap wrapped both once either was out of [0, 1],
+     * so 1.0 on one axis became 0.0 when the other was out of range, here it stays 1.0. */
+    template <> inline float __wrap_coord__<TEXTURE_WRAP_REPEAT>(float c)
+    {
+        return __saturate__((c >= 0.0f && c <= 1.0f) ? c : c - glm::floor(c));
+    }
+
+    template <> inline float __wrap_coord__<TEXTURE_WRAP_CLAMP_TO_EDGE>(float c)
+    {
+        return __saturate__(c);
+    }
+
+    template <> inline float __wrap_coord__<TEXTURE_WRAP_CLAMP_TO_BORDER>(float c)
+    {
+        return __saturate__(c);
+    }
+
+    template <int W>
+    static void __wrap_coords__(const float u[], const float v[], int num, float outU[], float outV[])
+    {
+        for (int i = 0; i < num; i++)
+        {
+            outU[i] = __wrap_coord__<W>(u[i]);
+            outV[i] = __wrap_coord__<W>(v[i]);
+        }
+    }
+
+/* Call the member template instantiated for the format and the layout of this texture. */
+#define __TEXTURE_FORMAT_DISPATCH__(func, L, ...) \
+    switch (mFormat) \
+    { \
+        case TEXTURE_FORMAT_RGBA8: return func<TEXTURE_FORMAT_RGBA8, L>(__VA_ARGS__); \
+        case TEXTURE_FORMAT_R8: return func<TEXTURE_FORMAT_R8, L>(__VA_ARGS__); \
+        case TEXTURE_FORMAT_RG8: return func<TEXTURE_FORMAT_RG8, L>(__VA_ARGS__); \
+        case TEXTURE_FORMAT_R16F: return func<TEXTURE_FORMAT_R16F, L>(__VA_ARGS__); \
+        case TEXTURE_FORMAT_R32F: return func<TEXTURE_FORMAT_R32F, L>(__VA_ARGS__); \
+        case TEXTURE_FORMAT_RG32F: return func<TEXTURE_FORMAT_RG32F, L>(__VA_ARGS__); \
+        case TEXTURE_FORMAT_RGBA32F: return func<TEXTURE_FORMAT_RGBA32F, L>(__VA_ARGS__); \
+    }
+
+#define __TEXTURE_DISPATCH__(func, ...) \
+    if (mLayout == TEXTURE_LAYOUT_TILED) \
+    { \
+        __TEXTURE_FORMAT_DISPATCH__(func, TEXTURE_LAYOUT_TILED, __VA_ARGS__) \
+    } \
+    else \
+    { \
+        __TEXTURE_FORMAT_DISPATCH__(func, TEXTURE_LAYOUT_LINEAR, __VA_ARGS__) \
+    }
+
+    TRTexture::TRTexture(const char *name, bool srgb, TRTextureLayout layout)
     {
         int width, height, nrChannels;
-        stbi_ldr_to_hdr_gamma(1.0f);
+        bool hdr = stbi_is_hdr(name);
+        void *texSrcData;
         stbi_set_flip_vertically_on_load(true);
-        float *texSrcData = stbi_loadf(name, &width, &height, &nrChannels, TEXTURE_CHANNEL);
+        if (hdr)
+            texSrcData = stbi_loadf(name, &width, &height, &nrChannels, 4);
+        else
+            texSrcData = stbi_load(name, &width, &height, &nrChannels, 4);
         if (!texSrcData)
         {
             std::cout << "Load texture " << name << " failed.\n";
             return;
         }
-        mW = width;
-        mH = height;
-        mPitch = mW * TEXTURE_CHANNEL;
-        mData = new float[mPitch * mH];
-        if (!mData)
+        mFormat = hdr ? TEXTURE_FORMAT_RGBA32F : TEXTURE_FORMAT_RGBA8;
+        mLayout = layout;
+        mSRGB = srgb;
+        if (!allocate(width, height))
             goto free_image;
 
-        std::cout << "Loading texture " << name << ", size " << mW << "x" << mH << "x" << nrChannels << ".\n";
-
-        for (int i = 0; i < mH; i++)
+        if (mLayout == TEXTURE_LAYOUT_LINEAR)
         {
-            float *src = texSrcData + i * mPitch;
-            float *dst = mData + i * mPitch;
-            for (int j = 0; j < mW; j++)
-            {
-                dst[j * TEXTURE_CHANNEL + 0] = src[j * TEXTURE_CHANNEL + 0];
-                dst[j * TEXTURE_CHANNEL + 1] = src[j * TEXTURE_CHANNEL + 1];
-                dst[j * TEXTURE_CHANNEL + 2] = src[j * TEXTURE_CHANNEL + 2];
-            }
+            // The layout of stb_image is the same as ours.
+            memcpy(mData, texSrcData, size_t(mPitch) * mH);
+        }
+        else
+        {
+            const uint8_t *src = reinterpret_cast<const uint8_t *>(texSrcData);
+            for (int y = 0; y < mH; y++)
+                for (int x = 0; x < mW; x++)
+                    memcpy(mData + texelOffset<TEXTURE_LAYOUT_TILED>(mLevels[0], x, y),
+                            src + (size_t(y) * mW + x) * mTexelSize, mTexelSize);
         }
 
         mOK = true;
+        generateMipmaps();
+
+        std::cout << "Loading texture " << name << ", size " << mW << "x" << mH << "x" << nrChannels
+            << ", " << getMemorySize() / 1024 << " KB.\n";
 
 free_image:
         stbi_image_free(texSrcData);
     }
 
-    TRTexture::TRTexture(int w, int h)
+    TRTexture::TRTexture(int w, int h, TRTextureFormat format, TRTextureLayout layout)
     {
-        mW = w;
-        mH = h;
-        mPitch = mW * TEXTURE_CHANNEL;
-        mData = new float[mPitch * mH];
-        if (mData)
+        mFormat = format;
+        mLayout = layout;
+        if (allocate(w, h))
+            mOK = true;
+    }
+
+    TRTexture::TRTexture(int w, int h, TRTextureFormat format, void *data)
+    {
+        mFormat = format;
+        mOwnData = false;
+        if (allocate(w, h, data))
             mOK = true;
     }
 
     TRTexture::~TRTexture()
     {
-        if (mData)
-            delete mData;
+        if (mData && mOwnData)
+            delete [] mData;
     }
 
-    float* TRTexture::getColor(float u, float v)
+    bool TRTexture::allocate(int w, int h, void *data)
+    {
+        mW = w;
+        mH = h;
+        mTexelSize = __texel_size__(mFormat);
+        mLut = __decode_lut__(mSRGB);
+        mData = data ? reinterpret_cast<uint8_t *>(data) : new uint8_t[getLevelSize(mW, mH)];
+        if (!mData)
+            return false;
+        mLevels.resize(1);
+        mLevels[0] = makeLevel(mData, mW, mH);
+        mPitch = mLevels[0].mPitch;
+        return true;
+    }
+
+    TRTexture::TRTextureLevel TRTexture::makeLevel(uint8_t *data, int w, int h) const
+    {
+        TRTextureLevel level;
+        level.mData = data;
+        level.mW = w;
+        level.mH = h;
+        if (mLayout == TEXTURE_LAYOUT_TILED)
+            level.mPitch = ((w + TEXTURE_TILE_MASK) & ~TEXTURE_TILE_MASK) * TEXTURE_TILE_SIZE * mTexelSize;
+        else
+            level.mPitch = w * mTexelSize;
+        return level;
+    }
+
+    size_t TRTexture::getLevelSize(int w, int h) const
+    {
+        // The tiled layout pads the level to whole tiles.
+        if (mLayout == TEXTURE_LAYOUT_TILED)
+            h = ((h + TEXTURE_TILE_MASK) & ~TEXTURE_TILE_MASK) / TEXTURE_TILE_SIZE;
+        return size_t(makeLevel(nullptr, w, h).mPitch) * h;
+    }
+
+    template <int L>
+    size_t TRTexture::texelOffset(const TRTextureLevel &level, int x, int y) const
+    {
+        if (L == TEXTURE_LAYOUT_TILED)
+            return size_t(y >> TEXTURE_TILE_SHIFT) * level.mPitch
+                + ((x >> TEXTURE_TILE_SHIFT) * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE
+                        + __morton_tile__(x & TEXTURE_TILE_MASK, y & TEXTURE_TILE_MASK)) * mTexelSize;
+        return size_t(y) * level.mPitch + x * mTexelSize;
+    }
+
+    template <int F, int L>
+    glm::vec4 TRTexture::nearest(float u, float v) const
     {
         int x = int(u * (mW - 1) + 0.5);
         int y = int(v * (mH - 1) + 0.5);
-        // Only support RGB texture now, but it should work for RGBA texture.
-        return mData + y * mPitch + x * TEXTURE_CHANNEL;
+        return __fetch__<F>(mData + texelOffset<L>(mLevels[0], x, y), mLut);
+    }
+
+    glm::vec4 TRTexture::getColor(float u, float v)
+    {
+        __TEXTURE_DISPATCH__(nearest, u, v);
+        return glm::vec4(0.0f);
+    }
+
+    template <int F, int L>
+    glm::vec4 TRTexture::bilinear(const TRTextureLevel &level, float u, float v) const
+    {
+        float x = u * (level.mW - 1);
+        float y = v * (level.mH - 1);
+        int x0 = int(x), y0 = int(y);
+        int x1 = glm::min(x0 + 1, level.mW - 1), y1 = glm::min(y0 + 1, level.mH - 1);
+        float fx = x - x0, fy = y - y0;
+
+        glm::vec4 t00 = __fetch__<F>(level.mData + texelOffset<L>(level, x0, y0), mLut);
+        glm::vec4 t01 = __fetch__<F>(level.mData + texelOffset<L>(level, x1, y0), mLut);
+        glm::vec4 t10 = __fetch__<F>(level.mData + texelOffset<L>(level, x0, y1), mLut);
+        glm::vec4 t11 = __fetch__<F>(level.mData + texelOffset<L>(level, x1, y1), mLut);
+        glm::vec4 top = t00 + (t01 - t00) * fx;
+        glm::vec4 bottom = t10 + (t11 - t10) * fx;
+        return top + (bottom - top) * fy;
+    }
+
+    template <int F, int L>
+    glm::vec4 TRTexture::trilinear(float u, float v, float lod) const
+    {
+        int maxLevel = int(mLevels.size()) - 1;
+        if (!(lod > 0.0f) || maxLevel == 0)
+            return bilinear<F, L>(mLevels[0], u, v);
+        if (lod >= maxLevel)
+            return bilinear<F, L>(mLevels[maxLevel], u, v);
+
+        int level = int(lod);
+        float f = lod - level;
+        glm::vec4 c0 = bilinear<F, L>(mLevels[level], u, v);
+        glm::vec4 c1 = bilinear<F, L>(mLevels[level + 1], u, v);
+        return c0 + (c1 - c0) * f;
+    }
+
+    glm::vec4 TRTexture::getColor(float u, float v, float lod)
+    {
+        __TEXTURE_DISPATCH__(trilinear, u, v, lod);
+        return glm::vec4(0.0f);
+    }
+
+    float TRTexture::getLod(glm::vec2 dx, glm::vec2 dy) const
+    {
+        glm::vec2 size(mW, mH);
+        float rho = glm::max(glm::length(dx * size), glm::length(dy * size));
+        return glm::log2(rho);
+    }
+
+    template <int F, int L>
+    void TRTexture::nearestBatch(const float u[], const float v[], int num, float *color[TEXTURE_CHANNEL]) const
+    {
+        constexpr int BATCH = 16;
+        size_t offset[BATCH];
+        for (int start = 0; start < num; start += BATCH)
+        {
+            int n = std::min(BATCH, num - start);
+            for (int i = 0; i < n; i++)
+            {
+                int x = int(u[start + i] * (mW - 1) + 0.5);
+                int y = int(v[start + i] * (mH - 1) + 0.5);
+                offset[i] = texelOffset<L>(mLevels[0], x, y);
+            }
+            for (int i = 0; i < n; i++)
+            {
+                glm::vec4 c = __fetch__<F>(mData + offset[i], mLut);
+                for (int j = 0; j < TEXTURE_CHANNEL; j++)
+                    color[j][start + i] = c[j];
+            }
+        }
+    }
+
+    void TRTexture::getColors(const float u[], const float v[], int num, float *color[TEXTURE_CHANNEL])
+    {
+        __TEXTURE_DISPATCH__(nearestBatch, u, v, num, color);
+    }
+
+    void TRTexture::getColors(const float u[], const float v[], const float lod[], int num, float *color[TEXTURE_CHANNEL])
+    {
+        for (int i = 0; i < num; i++)
+        {
+            glm::vec4 c = getColor(u[i], v[i], lod[i]);
+            for (int j = 0; j < TEXTURE_CHANNEL; j++)
+                color[j][i] = c[j];
+        }
+    }
+
+    glm::vec4 TRTexture::sample(const TRSampler &sampler, float u, float v, float lod)
+    {
+        switch (sampler.mWrap)
+        {
+            case TEXTURE_WRAP_REPEAT:
+                u = __wrap_coord__<TEXTURE_WRAP_REPEAT>(u);
+                v = __wrap_coord__<TEXTURE_WRAP_REPEAT>(v);
+                break;
+            case TEXTURE_WRAP_CLAMP_TO_BORDER:
+                if (!(u >= 0.0f && u <= 1.0f && v >= 0.0f && v <= 1.0f))
+                    return sampler.mBorderColor;
+                // fall through
+            case TEXTURE_WRAP_CLAMP_TO_EDGE:
+                u = __wrap_coord__<TEXTURE_WRAP_CLAMP_TO_EDGE>(u);
+                v = __wrap_coord__<TEXTURE_WRAP_CLAMP_TO_EDGE>(v);
+                break;
+        }
+        switch (sampler.mFilter)
+        {
+            case TEXTURE_FILTER_NEAREST:
+                return getColor(u, v);
+            case TEXTURE_FILTER_LINEAR:
+                return getColor(u, v, 0.0f);
+            case TEXTURE_FILTER_TRILINEAR:
+                return getColor(u, v, lod);
+        }
+        return glm::vec4(0.0f);
+    }
+
+    /* Bilinear filtering of num (<= TEXTURE_SAMPLE_BATCH) texels, every texel may use another level.
+     * The addresses and the weights of the 2x2 footprints are computed for all of the texels first,
+     * then the 4 texels of every footprint are fetched and the blending runs over all of the texels. */
+    constexpr int TEXTURE_SAMPLE_BATCH = 16;
+
+    template <int F, int L>
+    void TRTexture::bilinearBatch(const int level[], const float u[], const float v[], int num, float *color[TEXTURE_CHANNEL]) const
+    {
+        const uint8_t *texel[4][TEXTURE_SAMPLE_BATCH];
+        float fx[TEXTURE_SAMPLE_BATCH], fy[TEXTURE_SAMPLE_BATCH];
+        for (int i = 0; i < num; i++)
+        {
+            const TRTextureLevel &lv = mLevels[level[i]];
+            float x = u[i] * (lv.mW - 1);
+            float y = v[i] * (lv.mH - 1);
+            int x0 = int(x), y0 = int(y);
+            int x1 = glm::min(x0 + 1, lv.mW - 1), y1 = glm::min(y0 + 1, lv.mH - 1);
+            fx[i] = x - x0;
+            fy[i] = y - y0;
+            texel[0][i] = lv.mData + texelOffset<L>(lv, x0, y0);
+            texel[1][i] = lv.mData + texelOffset<L>(lv, x1, y0);
+            texel[2][i] = lv.mData + texelOffset<L>(lv, x0, y1);
+            texel[3][i] = lv.mData + texelOffset<L>(lv, x1, y1);
+        }
+
+        float t[4][TEXTURE_CHANNEL][TEXTURE_SAMPLE_BATCH];
+        for (int i = 0; i < num; i++)
+            for (int k = 0; k < 4; k++)
+            {
+                glm::vec4 c = __fetch__<F>(texel[k][i], mLut);
+                for (int j = 0; j < TEXTURE_CHANNEL; j++)
+                    t[k][j][i] = c[j];
+            }
+
+        for (int j = 0; j < TEXTURE_CHANNEL; j++)
+            for (int i = 0; i < num; i++)
+            {
+                float top = t[0][j][i] + (t[1][j][i] - t[0][j][i]) * fx[i];
+                float bottom = t[2][j][i] + (t[3][j][i] - t[2][j][i]) * fx[i];
+                color[j][i] = top + (bottom - top) * fy[i];
+            }
+    }
+
+    template <int F, int L>
+    void TRTexture::sampleBatch(const TRSampler &sampler, const float u[], const float v[], const float lod[], int num, float *color[TEXTURE_CHANNEL]) const
+    {
+        int maxLevel = int(mLevels.size()) - 1;
+        float wu[TEXTURE_SAMPLE_BATCH], wv[TEXTURE_SAMPLE_BATCH];
+        for (int start = 0; start < num; start += TEXTURE_SAMPLE_BATCH)
+        {
+            int n = std::min(TEXTURE_SAMPLE_BATCH, num - start);
+            float *out[TEXTURE_CHANNEL];
+            for (int j = 0; j < TEXTURE_CHANNEL; j++)
+                out[j] = color[j] + start;
+
+            switch (sampler.mWrap)
+            {
+                case TEXTURE_WRAP_REPEAT:
+                    __wrap_coords__<TEXTURE_WRAP_REPEAT>(u + start, v + start, n, wu, wv);
+                    break;
+                case TEXTURE_WRAP_CLAMP_TO_EDGE:
+                    __wrap_coords__<TEXTURE_WRAP_CLAMP_TO_EDGE>(u + start, v + start, n, wu, wv);
+                    break;
+                case TEXTURE_WRAP_CLAMP_TO_BORDER:
+                    __wrap_coords__<TEXTURE_WRAP_CLAMP_TO_BORDER>(u + start, v + start, n, wu, wv);
+                    break;
+            }
+
+            switch (sampler.mFilter)
+            {
+                case TEXTURE_FILTER_NEAREST:
+                    nearestBatch<F, L>(wu, wv, n, out);
+                    break;
+                case TEXTURE_FILTER_LINEAR:
+                {
+                    int level[TEXTURE_SAMPLE_BATCH] = { 0 };
+                    bilinearBatch<F, L>(level, wu, wv, n, out);
+                    break;
+                }
+                case TEXTURE_FILTER_TRILINEAR:
+                {
+                    int level0[TEXTURE_SAMPLE_BATCH], level1[TEXTURE_SAMPLE_BATCH];
+                    float f[TEXTURE_SAMPLE_BATCH], c1[TEXTURE_CHANNEL][TEXTURE_SAMPLE_BATCH];
+                    float *out1[TEXTURE_CHANNEL];
+                    for (int j = 0; j < TEXTURE_CHANNEL; j++)
+                        out1[j] = c1[j];
+                    for (int i = 0; i < n; i++)
+                    {
+                        // Same as trilinear, NaN goes to level 0.
+                        float l = lod[start + i];
+                        bool inside = l > 0.0f && l < maxLevel;
+                        level0[i] = inside ? int(l) : (l > 0.0f ? maxLevel : 0);
+                        level1[i] = glm::min(level0[i] + 1, maxLevel);
+                        f[i] = inside ? l - level0[i] : 0.0f;
+                    }
+                    bilinearBatch<F, L>(level0, wu, wv, n, out);
+                    bilinearBatch<F, L>(level1, wu, wv, n, out1);
+                    for (int j = 0; j < TEXTURE_CHANNEL; j++)
+                        for (int i = 0; i < n; i++)
+                            out[j][i] += (c1[j][i] - out[j][i]) * f[i];
+                    break;
+                }
+            }
+
+            if (sampler.mWrap == TEXTURE_WRAP_CLAMP_TO_BORDER)
+            {
+                for (int i = 0; i < n; i++)
+                {
+                    float s = u[start + i], t = v[start + i];
+                    bool outside = !(s >= 0.0f && s <= 1.0f && t >= 0.0f && t <= 1.0f);
+                    for (int j = 0; j < TEXTURE_CHANNEL; j++)
+                        out[j][i] = outside ? sampler.mBorderColor[j] : out[j][i];
+                }
+            }
+        }
+    }
+
+    void TRTexture::sample(const TRSampler &sampler, const float u[], const float v[], const float lod[], int num, float *color[TEXTURE_CHANNEL])
+    {
+        __TEXTURE_DISPATCH__(sampleBatch, sampler, u, v, lod, num, color);
+    }
+
+    template <int F, int L>
+    void TRTexture::compareBatch(const TRSampler &sampler, const float u[], const float v[], const float ref[], int num, float lit[]) const
+    {
+        const int r = sampler.mPCFRadius;
+        const float norm = 1.0f / ((r + 1) * (r + 1) * (r + 1) * (r + 1));
+        // Keep the center in a range which the taps can leave the texture from, NaN goes to the low end.
+        const float minX = -(r + 1), maxX = mW + r, minY = -(r + 1), maxY = mH + r;
+        int cx[TEXTURE_SAMPLE_BATCH], cy[TEXTURE_SAMPLE_BATCH];
+        for (int start = 0; start < num; start += TEXTURE_SAMPLE_BATCH)
+        {
+            int n = std::min(TEXTURE_SAMPLE_BATCH, num - start);
+            for (int i = 0; i < n; i++)
+            {
+                float x = u[start + i] * (mW - 1) + 0.5f, y = v[start + i] * (mH - 1) + 0.5f;
+                x = x >= minX ? x : minX;
+                y = y >= minY ? y : minY;
+                cx[i] = int(glm::floor(x <= maxX ? x : maxX));
+                cy[i] = int(glm::floor(y <= maxY ? y : maxY));
+                lit[start + i] = 0.0f;
+            }
+
+            // Texel offsets are integers, so the step is one texel of this texture whatever its size is.
+            for (int j = -r; j <= r; j++)
+                for (int k = -r; k <= r; k++)
+                {
+                    float weight = float((r + 1 - std::abs(j)) * (r + 1 - std::abs(k)));
+                    size_t offset[TEXTURE_SAMPLE_BATCH];
+                    bool inside[TEXTURE_SAMPLE_BATCH];
+                    float stored[TEXTURE_SAMPLE_BATCH];
+                    for (int i = 0; i < n; i++)
+                    {
+                        int x = cx[i] + k, y = cy[i] + j;
+                        inside[i] = x >= 0 && x < mW && y >= 0 && y < mH;
+                        offset[i] = texelOffset<L>(mLevels[0], glm::clamp(x, 0, mW - 1), glm::clamp(y, 0, mH - 1));
+                    }
+                    for (int i = 0; i < n; i++)
+                        stored[i] = __fetch__<F>(mData + offset[i], mLut).x;
+                    for (int i = 0; i < n; i++)
+                        lit[start + i] += (!inside[i] || ref[start + i] <= stored[i]) ? weight : 0.0f;
+                }
+
+            for (int i = 0; i < n; i++)
+                lit[start + i] *= norm;
+        }
+    }
+
+    float TRTexture::sampleCompare(const TRSampler &sampler, float u, float v, float ref)
+    {
+        float lit;
+        sampleCompare(sampler, &u, &v, &ref, 1, &lit);
+        return lit;
+    }
+
+    void TRTexture::sampleCompare(const TRSampler &sampler, const float u[], const float v[], const float ref[], int num, float lit[])
+    {
+        __TEXTURE_DISPATCH__(compareBatch, sampler, u, v, ref, num, lit);
+    }
+
+    template <int F, int L>
+    void TRTexture::store(int x, int y, const float color[])
+    {
+        __store__<F>(mData + texelOffset<L>(mLevels[0], x, y), color, mSRGB);
+    }
+
+    void TRTexture::setColor(int x, int y, const float color[])
+    {
+        __TEXTURE_DISPATCH__(store, x, y, color);
+    }
+
+    void TRTexture::clear(const float color[])
+    {
+        // Encode once and copy the texel over the whole level, the padding of the tiles too.
+        setColor(0, 0, color);
+        size_t size = getLevelSize(mW, mH);
+        for (size_t i = mTexelSize; i < size; i += mTexelSize)
+            memcpy(mData + i, mData, mTexelSize);
+    }
+
+    template <int F, int L>
+    void TRTexture::downsample(const TRTextureLevel &src, const TRTextureLevel &dst) const
+    {
+        // 2x2 box filter in linear space, the last row and column of the odd sizes are clamped.
+        trParallelFor(dst.mH, [&](size_t start, size_t num)
+        {
+            for (size_t y = start; y < start + num; y++)
+            {
+                int sy0 = glm::min(int(y) * 2, src.mH - 1), sy1 = glm::min(int(y) * 2 + 1, src.mH - 1);
+                for (int x = 0; x < dst.mW; x++)
+                {
+                    int sx0 = glm::min(x * 2, src.mW - 1), sx1 = glm::min(x * 2 + 1, src.mW - 1);
+                    glm::vec4 c = (__fetch__<F>(src.mData + texelOffset<L>(src, sx0, sy0), mLut)
+                            + __fetch__<F>(src.mData + texelOffset<L>(src, sx1, sy0), mLut)
+                            + __fetch__<F>(src.mData + texelOffset<L>(src, sx0, sy1), mLut)
+                            + __fetch__<F>(src.mData + texelOffset<L>(src, sx1, sy1), mLut)) * 0.25f;
+                    float out[4] = { c.x, c.y, c.z, c.w };
+                    __store__<F>(dst.mData + texelOffset<L>(dst, x, int(y)), out, mSRGB);
+                }
+            }
+        });
     }
 
-    float* TRTexture::getBuffer()
+    void TRTexture::downsampleLevel(const TRTextureLevel &src, const TRTextureLevel &dst)
+    {
+        __TEXTURE_DISPATCH__(downsample, src, dst);
+    }
+
+    void TRTexture::generateMipmaps()
+    {
+        mLevels.resize(1);
+
+        size_t size = 0;
+        for (int w = mW, h = mH; w > 1 || h > 1;)
+        {
+            w = glm::max(w / 2, 1);
+            h = glm::max(h / 2, 1);
+            size += getLevelSize(w, h);
+        }
+        mMipData.resize(size);
+
+        uint8_t *data = mMipData.data();
+        while (mLevels.back().mW > 1 || mLevels.back().mH > 1)
+        {
+            const TRTextureLevel src = mLevels.back();
+            TRTextureLevel dst = makeLevel(data, glm::max(src.mW / 2, 1), glm::max(src.mH / 2, 1));
+            data += getLevelSize(dst.mW, dst.mH);
+            downsampleLevel(src, dst);
+            mLevels.push_back(dst);
+        }
+    }
+
+    int TRTexture::getLevelNum() const
+    {
+        return mLevels.size();
+    }
+
+    void* TRTexture::getBuffer()
     {
         return mData;
     }
 
+    TRTextureFormat TRTexture::getFormat() const
+    {
+        return mFormat;
+    }
+
+    TRTextureLayout TRTexture::getLayout() const
+    {
+        return mLayout;
+    }
+
+    size_t TRTexture::getMemorySize() const
+    {
+        return getLevelSize(mW, mH) + mMipData.size();
+    }
+
     bool TRTexture::OK() const
     {
         return mOK;
@@ -90,13 +802,160 @@ free_image:
 
     float TRTexture::getXStep() const
     {
-        static float xstep = 1.0f / mW;
-        return xstep;
+        return 1.0f / mW;
     }
 
     float TRTexture::getYStep() const
     {
-        static float ystep = 1.0f / mH;
-        return ystep;
+        return 1.0f / mH;
+    }
+
+    TRCubeTexture::TRCubeTexture(const std::string names[TEXTURE_CUBE_FACE_MAX])
+    {
+        for (int i = 0; i < TEXTURE_CUBE_FACE_MAX; i++)
+        {
+            mFaces[i] = new TRTexture(names[i].c_str());
+            if (!mFaces[i]->OK())
+                return;
+        }
+        mOK = true;
+    }
+
+    TRCubeTexture::~TRCubeTexture()
+    {
+        for (int i = 0; i < TEXTURE_CUBE_FACE_MAX; i++)
+            if (mFaces[i])
+                delete mFaces[i];
+    }
+
+    glm::vec4 TRCubeTexture::sample(const TRSampler &sampler, glm::vec3 dir, glm::vec3 dx, glm::vec3 dy)
+    {
+        glm::vec3 a = glm::abs(dir);
+        /* Pick the face of the major axis, s and t are the axes of u and v on the face. */
+        int face, major, s, t;
+        float su, sv;
+        if (a.y >= a.x && a.y >= a.z)
+        {
+            major = 1, s = 0, t = 2;
+            face = dir.y < 0 ? TEXTURE_CUBE_BOTTOM : TEXTURE_CUBE_TOP;
+            su = 1.0f;
+            sv = dir.y < 0 ? -1.0f : 1.0f;
+        }
+        else if (a.z >= a.x)
+        {
+            major = 2, s = 0, t = 1;
+            face = dir.z < 0 ? TEXTURE_CUBE_FRONT : TEXTURE_CUBE_BACK;
+            su = dir.z < 0 ? 1.0f : -1.0f;
+            sv = 1.0f;
+        }
+        else
+        {
+            major = 0, s = 2, t = 1;
+            face = dir.x < 0 ? TEXTURE_CUBE_LEFT : TEXTURE_CUBE_RIGHT;
+            su = dir.x < 0 ? -1.0f : 1.0f;
+            sv = 1.0f;
+        }
+
+        float m = a[major];
+        float sign = dir[major] < 0 ? -1.0f : 1.0f;
+        float u = 0.5f * (su * dir[s] / m + 1.0f);
+        float v = 0.5f * (sv * dir[t] / m + 1.0f);
+        // Quotient rule of dir[s] / |dir[major]|.
+        float dm = sign * dx[major], dn = sign * dy[major];
+        glm::vec2 du(0.5f * su * (dx[s] * m - dir[s] * dm), 0.5f * sv * (dx[t] * m - dir[t] * dm));
+        glm::vec2 dv(0.5f * su * (dy[s] * m - dir[s] * dn), 0.5f * sv * (dy[t] * m - dir[t] * dn));
+        du /= m * m;
+        dv /= m * m;
+
+        TRTexture *texture = mFaces[face];
+        return texture->sample(sampler, u, v, texture->getLod(du, dv));
+    }
+
+    TRTexture *TRCubeTexture::getFace(int face)
+    {
+        return mFaces[face];
+    }
+
+    bool TRCubeTexture::OK() const
+    {
+        return mOK;
+    }
+
+    TRVarianceShadowMap::TRVarianceShadowMap(int w, int h, int radius)
+    {
+        mRadius = radius;
+        mMoments = new TRTexture(w, h, TEXTURE_FORMAT_RG32F);
+        mTemp.resize(size_t(w) * h * 2);
+    }
+
+    TRVarianceShadowMap::~TRVarianceShadowMap()
+    {
+        if (mMoments)
+            delete mMoments;
+    }
+
+    void TRVarianceShadowMap::update(TRTexture *depth)
+    {
+        assert(depth->getFormat() == TEXTURE_FORMAT_R32F && depth->getLayout() == TEXTURE_LAYOUT_LINEAR);
+        assert(depth->getW() == mMoments->getW() && depth->getH() == mMoments->getH());
+
+        const int w = mMoments->getW(), h = mMoments->getH(), r = mRadius;
+        const float norm = 1.0f / (2 * r + 1);
+        const float *src = reinterpret_cast<const float *>(depth->getBuffer());
+        float *temp = mTemp.data();
+        float *dst = reinterpret_cast<float *>(mMoments->getBuffer());
+
+        // Horizontal pass, a running sum of the moments along the row, the edges are clamped.
+        trParallelFor(h, [&](size_t start, size_t num)
+        {
+            for (size_t y = start; y < start + num; y++)
+            {
+                const float *row = src + y * w;
+                float *out = temp + y * w * 2;
+                float m1 = 0.0f, m2 = 0.0f;
+                for (int x = -r - 1; x < r; x++)
+                {
+                    float d = row[glm::clamp(x, 0, w - 1)];
+                    m1 += d;
+                    m2 += d * d;
+                }
+                for (int x = 0; x < w; x++)
+                {
+                    float in = row[glm::min(x + r, w - 1)], out0 = row[glm::max(x - r - 1, 0)];
+                    m1 += in - out0;
+                    m2 += in * in - out0 * out0;
+                    out[x * 2 + 0] = m1 * norm;
+                    out[x * 2 + 1] = m2 * norm;
+                }
+            }
+        });
+
+        // Vertical pass, every output row sums the rows of its window, it runs along x so it vectorizes.
+        trParallelFor(h, [&](size_t start, size_t num)
+        {
+            for (size_t y = start; y < start + num; y++)
+            {
+                float *out = dst + y * w * 2;
+                std::fill(out, out + w * 2, 0.0f);
+                for (int k = -r; k <= r; k++)
+                {
+                    const float *row = temp + glm::clamp(int(y) + k, 0, h - 1) * w * 2;
+                    for (int x = 0; x < w * 2; x++)
+                        out[x] += row[x];
+                }
+                for (int x = 0; x < w * 2; x++)
+                    out[x] *= norm;
+            }
+        });
+    }
+
+    TRTexture *TRVarianceShadowMap::getTexture()
+    {
+        return mMoments;
+    }
+
+    bool TRVarianceShadowMap::OK() const
+    {
+        return mMoments && mMoments->OK();
     }
 }
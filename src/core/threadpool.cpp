@@ -0,0 +1,86 @@
+#include "threadpool.hpp"
+
+namespace TGRenderer
+{
+    TRThreadPool::~TRThreadPool()
+    {
+        stop();
+    }
+
+    void TRThreadPool::stop()
+    {
+        {
+            std::lock_guard<std::mutex> lck(mMutex);
+            mStop = true;
+        }
+        mStartCond.notify_all();
+        for (auto &th : mWorkers)
+            if (th.joinable())
+                th.join();
+        mWorkers.clear();
+        mStop = false;
+    }
+
+    void TRThreadPool::setThreadNum(size_t num)
+    {
+        if (num == 0)
+            num = 1;
+        if (num == getThreadNum())
+            return;
+
+        stop();
+        for (size_t i = 1; i < num; i++)
+            mWorkers.push_back(std::thread(&TRThreadPool::workerLoop, this, i, mGeneration));
+    }
+
+    size_t TRThreadPool::getThreadNum() const
+    {
+        return mWorkers.size() + 1;
+    }
+
+    void TRThreadPool::run(const Job &job)
+    {
+        if (mWorkers.empty())
+        {
+            job(0);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lck(mMutex);
+            mJob = &job;
+            mPending = mWorkers.size();
+            mGeneration++;
+        }
+        mStartCond.notify_all();
+
+        job(0);
+
+        // Barrier: wait for all of the workers.
+        std::unique_lock<std::mutex> lck(mMutex);
+        mDoneCond.wait(lck, [this] { return mPending == 0; });
+        mJob = nullptr;
+    }
+
+    void TRThreadPool::workerLoop(size_t id, size_t generation)
+    {
+        while (true)
+        {
+            const Job *job = nullptr;
+            {
+                std::unique_lock<std::mutex> lck(mMutex);
+                mStartCond.wait(lck, [this, generation] { return mStop || mGeneration != generation; });
+                if (mStop)
+                    return;
+                generation = mGeneration;
+                job = mJob;
+            }
+
+            (*job)(id);
+
+            std::lock_guard<std::mutex> lck(mMutex);
+            if (--mPending == 0)
+                mDoneCond.notify_one();
+        }
+    }
+}
@@ -1,15 +1,21 @@
 #include <string>
 #include <vector>
-#include <thread>
+#include <algorithm>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <cfloat>
 
 #include "trcore.hpp"
+#include "threadpool.hpp"
 
 namespace TGRenderer
 {
     // global value
     TRBuffer *gRenderTarget = nullptr;
     TRTexture *gTexture[TEXTURE_INDEX_MAX] = { nullptr };
+    TRSampler gDefaultSampler;
+    TRSampler *gSampler[TEXTURE_INDEX_MAX] = { nullptr };
     void *gUniform = nullptr;
 
     glm::mat4 gDefaultMat4[MAT_INDEX_MAX] =
@@ -38,14 +44,41 @@ namespace TGRenderer
     };
 
     thread_local Program gProgram;
+    // programs for binning mode, the geometry results must be kept until the raster stage
+    Program gBinProgram[THREAD_MAX];
+    std::atomic<size_t> gNextTile;
 
     size_t gThreadNum = 4;
+    TRThreadPool gThreadPool;
+    // trParallelFor runs on its own threads, so the texture work doesn't follow or resize the render threads.
+    TRThreadPool gJobThreadPool;
     TRPolygonMode gPolygonMode = TR_FILL;
     TRDrawMode gDrawMode = TR_TRIANGLES;
+    bool gDrawIndexed = false;
+    const TRRasterFuncs *gRaster = nullptr;
+    const TRVaryingLayout *gLayout = nullptr;
+    bool gFragmentBatch = false;
+    bool gEnableVertexBatch = false;
+    bool gEnableVertexReuse = false;
+    // batch 0 is the scratch one, the others are kept for reuse
+    std::vector<TRVertexBatch> gVertexBatches(1);
+    size_t gVertexBatchTick = 0;
+    // results of the batched vertex stage for current draw, nullptr for the immediate mode
+    TRVertexBatch *gVertexBatch = nullptr;
     TRCullFaceMode gCullFace = TR_NONE;
     bool gEnableDepthTest = true;
+    TRDepthFunc gDepthFunc = TR_LEQUAL;
+    bool gDepthMask = true;
+    bool gEnableColorWrite = true;
     bool gEnableStencilTest = false;
     bool gEnableStencilWrite = false;
+    bool gEnableBinning = false;
+    TRShadingMode gShadingMode = TR_SHADING_FORWARD;
+    // draw ID of the visibility buffer, counted from the start of pass
+    size_t gDrawId = 0;
+    size_t gDrawNum = 0;
+    std::vector<std::vector<bool>> gVisiblePrims;
+    TRSpanFunc gSpanFunc = trGetSpanFunc();
 #if __DEBUG_FINISH_CB__
     fcb gFCB = nullptr;
     void *gFCBData = nullptr;
@@ -64,25 +97,82 @@ namespace TGRenderer
         return (c.x - a.x)*(b.y - a.y) - (c.y - a.y)*(b.x - a.x);
     }
 
+    static inline size_t __get_prims_count__(TRMeshData &mesh)
+    {
+        return (gDrawIndexed ? mesh.indices.size() : mesh.vertices.size()) / gDrawMode;
+    }
+
+    static inline size_t __get_vertex_index__(TRMeshData &mesh, size_t element)
+    {
+        return gDrawIndexed ? mesh.indices[element] : element;
+    }
+
+    static inline bool __depth_test__(float depth, float stored)
+    {
+        switch (gDepthFunc)
+        {
+            case TR_NEVER: return false;
+            case TR_LESS: return depth < stored;
+            case TR_EQUAL: return depth == stored;
+            case TR_LEQUAL: return depth <= stored;
+            case TR_GREATER: return depth > stored;
+            case TR_NOTEQUAL: return depth != stored;
+            case TR_GEQUAL: return depth >= stored;
+            case TR_ALWAYS: return true;
+            default: assert(false); return true;
+        }
+    }
+
+    /* Depth never goes up with these functions, so Hi-Z and the early depth test of span can reject the far pixels.
+     * Deferred pass has no depth test, the depth was resolved by the visibility pass. */
+    static inline bool __early_depth_test__()
+    {
+        return gEnableDepthTest && gShadingMode != TR_SHADING_DEFERRED
+            && (gDepthFunc == TR_LESS || gDepthFunc == TR_LEQUAL || gDepthFunc == TR_EQUAL);
+    }
+
+    static inline uint64_t __visibility_id__(size_t index)
+    {
+        return (uint64_t(gDrawId) << 32) | uint32_t(index);
+    }
+
+    static inline bool __is_prim_visible__(size_t index)
+    {
+        return gDrawId < gVisiblePrims.size() && index < gVisiblePrims[gDrawId].size() && gVisiblePrims[gDrawId][index];
+    }
+
     void TRMeshData::computeTangent()
     {
         if (tangents.size() != 0)
             return;
 
-        for (size_t i = 0; i < vertices.size(); i += 3)
+        // Per vertex tangent, shared vertices get the sum of the triangles.
+        tangents.resize(vertices.size(), glm::vec3(0.0f));
+        size_t count = indices.empty() ? vertices.size() : indices.size();
+        for (size_t i = 0; i + 2 < count; i += 3)
         {
+            size_t i0 = i, i1 = i + 1, i2 = i + 2;
+            if (!indices.empty())
+            {
+                i0 = indices[i];
+                i1 = indices[i + 1];
+                i2 = indices[i + 2];
+            }
+
             // Edges of the triangle : postion delta
-            glm::vec3 deltaPos1 = vertices[i+1] - vertices[i];
-            glm::vec3 deltaPos2 = vertices[i+2] - vertices[i];
+            glm::vec3 deltaPos1 = vertices[i1] - vertices[i0];
+            glm::vec3 deltaPos2 = vertices[i2] - vertices[i0];
 
             // UV delta
-            glm::vec2 deltaUV1 = texcoords[i+1]-texcoords[i];
-            glm::vec2 deltaUV2 = texcoords[i+2]-texcoords[i];
+            glm::vec2 deltaUV1 = texcoords[i1]-texcoords[i0];
+            glm::vec2 deltaUV2 = texcoords[i2]-texcoords[i0];
 
             float r = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);
 
             glm::vec3 T = (deltaPos1 * deltaUV2.y   - deltaPos2 * deltaUV1.y) * r;
-            tangents.push_back(T);
+            tangents[i0] += T;
+            tangents[i1] += T;
+            tangents[i2] += T;
         }
     }
 
@@ -116,16 +206,92 @@ namespace TGRenderer
         mShader = shader;
     }
 
+    void Program::enableBinning(bool enable)
+    {
+        mBinning = enable;
+    }
+
+    Program::Program()
+    {
+        for (size_t i = 0; i < MAX_VSDATA_NUM; i++)
+            mVSOutData[i].mVarying = mVSOutVarying[i];
+        for (size_t i = 0; i < VERTEX_CACHE_SIZE; i++)
+            mVertexCache[i].mVarying = mVSOutVarying[MAX_VSDATA_NUM + i];
+    }
+
     VSOutData *Program::allocVSOutData()
     {
         return &mVSOutData[mAllocIndex++];
     }
 
+    void Program::resetVertexCache()
+    {
+        for (size_t i = 0; i < VERTEX_CACHE_SIZE; i++)
+            mVertexCacheTag[i] = VERTEX_CACHE_INVALID;
+    }
+
+    VSOutData *Program::shadeVertex(TRMeshData &mesh, size_t element, VSOutData *prim[], int num)
+    {
+        VSOutData *vsdata = nullptr;
+        if (gVertexBatch)
+            return &gVertexBatch->mVSOutData[__get_vertex_index__(mesh, element)];
+
+        if (!gDrawIndexed)
+        {
+            vsdata = allocVSOutData();
+            vsdata->mLayout = mLayout;
+            mShader->vertex(mesh, vsdata, element);
+            return vsdata;
+        }
+
+        size_t index = mesh.indices[element];
+        size_t slot = index & (VERTEX_CACHE_SIZE - 1);
+        vsdata = &mVertexCache[slot];
+        if (mVertexCacheTag[slot] == index)
+            return vsdata;
+
+        // The slot is used by the other vertex of this primitive, can't evict it.
+        for (int i = 0; i < num; i++)
+            if (prim[i] == vsdata)
+            {
+                vsdata = allocVSOutData();
+                vsdata->mLayout = mLayout;
+                mShader->vertex(mesh, vsdata, index);
+                return vsdata;
+            }
+
+        vsdata->mLayout = mLayout;
+        mShader->vertex(mesh, vsdata, index);
+        mVertexCacheTag[slot] = index;
+        return vsdata;
+    }
+
+    bool Program::isOutside(TRMeshData &mesh, size_t first, int num)
+    {
+        if (!gVertexBatch)
+            return false;
+        uint8_t outcode = OUTCODE_FRUSTUM;
+        for (int i = 0; i < num; i++)
+            outcode &= gVertexBatch->mOutcode[__get_vertex_index__(mesh, first + i)];
+        return outcode != 0;
+    }
+
     void Program::freeShaderData()
     {
         mAllocIndex = 0;
     }
 
+    void Program::setupDraw()
+    {
+        mRaster = gRaster;
+        mLayout = gLayout;
+        mSpanFunc = gSpanFunc;
+        mEarlyDepthTest = __early_depth_test__();
+        mColorWrite = gEnableColorWrite && mBuffer->hasColor();
+        /* Nothing to shade in the visibility pass or without color write. */
+        mFragmentBatch = gFragmentBatch && gShadingMode != TR_SHADING_VISIBILITY && mColorWrite;
+    }
+
     void Program::preDraw()
     {
         assert(mBuffer != nullptr);
@@ -145,62 +311,16 @@ namespace TGRenderer
 #endif
     }
 
-    void Program::prepareFragmentData(VSOutData *vsdata[], int num)
-    {
-        assert(num > 0 && num < 4);
-        size_t v2n, v3n, v4n;
-        mShader->getVaryingNum(v2n, v3n, v4n);
-
-        mFSInData.tr_PositionPrim[0] = vsdata[0]->tr_Position;
-        if (num > 1)
-            mFSInData.tr_PositionPrim[1] = vsdata[1]->tr_Position - vsdata[0]->tr_Position;
-        if (num > 2)
-            mFSInData.tr_PositionPrim[2] = vsdata[2]->tr_Position - vsdata[0]->tr_Position;
-
-        for (size_t i = 0; i < v2n; i++)
-        {
-            mFSInData.mVaryingVec2Prim[i][0] = vsdata[0]->mVaryingVec2[i];
-            if (num > 1)
-                mFSInData.mVaryingVec2Prim[i][1] = vsdata[1]->mVaryingVec2[i] - vsdata[0]->mVaryingVec2[i];
-            if (num > 2)
-                mFSInData.mVaryingVec2Prim[i][2] = vsdata[2]->mVaryingVec2[i] - vsdata[0]->mVaryingVec2[i];
-        }
-        for (size_t i = 0; i < v3n; i++)
-        {
-            mFSInData.mVaryingVec3Prim[i][0] = vsdata[0]->mVaryingVec3[i];
-            if (num > 1)
-                mFSInData.mVaryingVec3Prim[i][1] = vsdata[1]->mVaryingVec3[i] - vsdata[0]->mVaryingVec3[i];
-            if (num > 2)
-                mFSInData.mVaryingVec3Prim[i][2] = vsdata[2]->mVaryingVec3[i] - vsdata[0]->mVaryingVec3[i];
-        }
-        for (size_t i = 0; i < v4n; i++)
-        {
-            mFSInData.mVaryingVec4Prim[i][0] = vsdata[0]->mVaryingVec4[i];
-            if (num > 1)
-                mFSInData.mVaryingVec4Prim[i][1] = vsdata[1]->mVaryingVec4[i] - vsdata[0]->mVaryingVec4[i];
-            if (num > 2)
-                mFSInData.mVaryingVec4Prim[i][2] = vsdata[2]->mVaryingVec4[i] - vsdata[0]->mVaryingVec4[i];
-        }
-    }
-
     constexpr float W_CLIPPING_PLANE = 0.1f;
 
     void Program::getIntersectionVertex(VSOutData *in1, VSOutData *in2, VSOutData *outV)
     {
-        size_t v2n, v3n, v4n;
-        mShader->getVaryingNum(v2n, v3n, v4n);
-
         float t = (in2->tr_Position.w - W_CLIPPING_PLANE)/(in2->tr_Position.w - in1->tr_Position.w);
 
-        for (size_t i = 0; i < v2n; i++)
-            outV->mVaryingVec2[i] = in2->mVaryingVec2[i] + t * (in1->mVaryingVec2[i] - in2->mVaryingVec2[i]);
-
-        for (size_t i = 0; i < v3n; i++)
-            outV->mVaryingVec3[i] = in2->mVaryingVec3[i] + t * (in1->mVaryingVec3[i] - in2->mVaryingVec3[i]);
-
-        for (size_t i = 0; i < v4n; i++)
-            outV->mVaryingVec4[i] = in2->mVaryingVec4[i] + t * (in1->mVaryingVec4[i] - in2->mVaryingVec4[i]);
+        for (size_t i = 0; i < mLayout->mSize; i++)
+            outV->mVarying[i] = in2->mVarying[i] + t * (in1->mVarying[i] - in2->mVarying[i]);
 
+        outV->mLayout = mLayout;
         outV->tr_Position = in2->tr_Position + t * (in1->tr_Position - in2->tr_Position);
     }
 
@@ -241,67 +361,75 @@ namespace TGRenderer
     void Program::drawPoint(TRMeshData &mesh, size_t index)
     {
         preDraw();
-        VSOutData *vsdata = allocVSOutData();
-        mShader->vertex(mesh, vsdata, index);
+        mVisibilityId = __visibility_id__(index);
+        VSOutData *vsdata = shadeVertex(mesh, index, nullptr, 0);
         if (vsdata->tr_Position.w >= W_CLIPPING_PLANE)
-            rasterizationPoint(vsdata);
+        {
+            if (mBinning)
+                binPrim(&vsdata, 1);
+            else
+                rasterizationPoint(vsdata);
+        }
         postDraw();
     }
 
     void Program::drawLine(TRMeshData &mesh, size_t index)
     {
+        if (isOutside(mesh, index * 2, 2))
+            return;
         preDraw();
+        mVisibilityId = __visibility_id__(index);
         VSOutData *vsdata[2];
         for (size_t i = 0; i < 2; i++)
-        {
-            vsdata[i] = allocVSOutData();
-            mShader->vertex(mesh, vsdata[i], index * 2 + i);
-        }
+            vsdata[i] = shadeVertex(mesh, index * 2 + i, vsdata, i);
 
         VSOutData *out[2] = { nullptr };
+        VSOutData **line = nullptr;
         size_t total = 0;
         if (vsdata[0]->tr_Position.w >= W_CLIPPING_PLANE
                 && vsdata[1]->tr_Position.w >= W_CLIPPING_PLANE)
         {
             // No need to clip on W
-            rasterizationLine(vsdata);
+            line = vsdata;
         }
         else if (vsdata[0]->tr_Position.w <= W_CLIPPING_PLANE
                 && vsdata[1]->tr_Position.w > W_CLIPPING_PLANE)
         {
             clipLineOnWAxis(vsdata[0], vsdata[1], out, total);
             assert(total == 2);
-            rasterizationLine(out);
+            line = out;
         }
         else if (vsdata[0]->tr_Position.w > W_CLIPPING_PLANE
                 && vsdata[1]->tr_Position.w <= W_CLIPPING_PLANE)
         {
             clipLineOnWAxis(vsdata[1], vsdata[0], out, total);
             assert(total == 2);
-            rasterizationLine(out);
+            line = out;
         }
+
+        if (line && mBinning)
+            binPrim(line, 2);
+        else if (line)
+            rasterizationLine(line);
         postDraw();
     }
 
     void Program::drawTriangle(TRMeshData &mesh, size_t index)
     {
+        if (isOutside(mesh, index * 3, 3))
+            return;
         preDraw();
+        mVisibilityId = __visibility_id__(index);
         VSOutData *vsdata[3];
         for (size_t i = 0; i < 3; i++)
-        {
-            vsdata[i] = allocVSOutData();
-            mShader->vertex(mesh, vsdata[i], index * 3 + i);
-        }
+            vsdata[i] = shadeVertex(mesh, index * 3 + i, vsdata, i);
 
         if (vsdata[0]->tr_Position.w >= W_CLIPPING_PLANE
                 && vsdata[1]->tr_Position.w >= W_CLIPPING_PLANE
                 && vsdata[2]->tr_Position.w >= W_CLIPPING_PLANE)
         {
             // No need to clip on W
-            if (gPolygonMode == TR_LINE)
-                rasterizationWireframe(vsdata);
-            else
-                rasterizationTriangle(vsdata);
+            emitTriangle(vsdata);
         }
         else
         {
@@ -314,21 +442,40 @@ namespace TGRenderer
                 vsdata[0] = out[0];
                 vsdata[1] = out[i + 1];
                 vsdata[2] = out[i + 2];
-                if (gPolygonMode == TR_LINE)
-                    rasterizationWireframe(vsdata);
-                else
-                    rasterizationTriangle(vsdata);
+                emitTriangle(vsdata);
             }
         }
         postDraw();
     }
 
+    void Program::emitTriangle(VSOutData *vsdata[3])
+    {
+        if (mBinning)
+            binPrim(vsdata, 3);
+        else if (gPolygonMode == TR_LINE)
+            rasterizationWireframe(vsdata);
+        else
+            rasterizationTriangle(vsdata);
+    }
+
     void Program::drawPrimsInstranced(TRMeshData &mesh, size_t index, size_t num)
     {
         size_t i = 0, j = 0;
-        size_t primsCount = mesh.vertices.size() / gDrawMode;
+        size_t primsCount = __get_prims_count__(mesh);
+
+        setupDraw();
+        mDrawArea = mBuffer->getDrawArea();
+        if (mBinning)
+            resetBins();
+        // Shader and matrices may be changed since the last draw.
+        if (gDrawIndexed && !gVertexBatch)
+            resetVertexCache();
 
         for (i = index, j = 0; i < primsCount && j < num; i++, j++)
+        {
+            // Nothing of this primitive was left in the visibility buffer.
+            if (gShadingMode == TR_SHADING_DEFERRED && !__is_prim_visible__(i))
+                continue;
             switch (gDrawMode)
             {
                 case TR_POINTS: drawPoint(mesh, i); break;
@@ -336,40 +483,194 @@ namespace TGRenderer
                 case TR_TRIANGLES: drawTriangle(mesh, i); break;
                 default: assert(false); break;
             }
+        }
     }
 
-    void Program::drawPixel(int x, int y, float depth)
+    void Program::binPrimsInstanced(TRMeshData &mesh, size_t index, size_t num)
     {
-        size_t offset = mBuffer->getOffset(x, y);
-        /* easy-z */
-        /* Do not use mutex here to speed up */
-        if (gEnableDepthTest && mBuffer->getDepth(offset) < depth)
+        // Same as the immediate mode, but all of the primitives will be put into the bins.
+        assert(mBinning);
+        drawPrimsInstranced(mesh, index, num);
+
+        // The pool doesn't grow anymore, point the vertices to their varyings for the raster stage.
+        for (size_t i = 0; i < mBinVSOutData.size(); i++)
+            mBinVSOutData[i].mVarying = mBinVarying.data() + i * mLayout->mSize;
+    }
+
+    void Program::resetBins()
+    {
+        mTileNumX = (mBuffer->getW() + TILE_SIZE - 1) >> TILE_SIZE_SHIFT;
+        size_t tileNum = mTileNumX * ((mBuffer->getH() + TILE_SIZE - 1) >> TILE_SIZE_SHIFT);
+
+        mBinVSOutData.clear();
+        mBinVarying.clear();
+        mBinPrims.clear();
+        // Keep the capacity of the bins, most of draws have the similar distribution.
+        if (mBins.size() != tileNum)
+            mBins.resize(tileNum);
+        for (auto &bin : mBins)
+            bin.clear();
+    }
+
+    void Program::binPrim(VSOutData *vsdata[], int num)
+    {
+        glm::vec2 screen[3];
+        glm::vec2 minV(FLT_MAX), maxV(-FLT_MAX);
+
+        for (int i = 0; i < num; i++)
+        {
+            glm::vec4 ndc = vsdata[i]->tr_Position / vsdata[i]->tr_Position.w;
+            screen[i] = mBuffer->viewportTransform(ndc);
+            minV = glm::vec2(glm::min(minV.x, screen[i].x), glm::min(minV.y, screen[i].y));
+            maxV = glm::vec2(glm::max(maxV.x, screen[i].x), glm::max(maxV.y, screen[i].y));
+        }
+
+        // Cull as early as possible, rasterizationTriangle will do the same check.
+        if (num == 3 && gPolygonMode == TR_FILL)
+        {
+            float area = __edge__(screen[0], screen[1], screen[2]);
+            if ((gCullFace == TR_CCW && area >= 0) || (gCullFace == TR_CW && area <= 0) || area == 0)
+                return;
+        }
+
+        // Conservative bounding box, 1 pixel extended for the rounding in rasterization.
+        int xStart = glm::max(float(mDrawArea[0]), minV.x - 1.0f);
+        int yStart = glm::max(float(mDrawArea[1]), minV.y - 1.0f);
+        int xEnd = glm::min(float(mDrawArea[2] - 1), maxV.x + 1.0f);
+        int yEnd = glm::min(float(mDrawArea[3] - 1), maxV.y + 1.0f);
+        if (xStart > xEnd || yStart > yEnd)
             return;
 
-        float color[4];
-        color[3] = 1.0f;
-        if (!mShader->fragment(&mFSInData, color))
+        TRBinPrim prim;
+        prim.mNum = num;
+        prim.mId = mVisibilityId;
+        for (int i = 0; i < num; i++)
+        {
+            prim.mVertex[i] = mBinVSOutData.size();
+            mBinVSOutData.emplace_back();
+            mBinVSOutData.back().tr_Position = vsdata[i]->tr_Position;
+            mBinVSOutData.back().mLayout = mLayout;
+            mBinVarying.insert(mBinVarying.end(), vsdata[i]->mVarying, vsdata[i]->mVarying + mLayout->mSize);
+        }
+        size_t primIndex = mBinPrims.size();
+        mBinPrims.push_back(prim);
+
+        for (int ty = yStart >> TILE_SIZE_SHIFT; ty <= yEnd >> TILE_SIZE_SHIFT; ty++)
+            for (int tx = xStart >> TILE_SIZE_SHIFT; tx <= xEnd >> TILE_SIZE_SHIFT; tx++)
+                mBins[ty * mTileNumX + tx].push_back(primIndex);
+    }
+
+    void Program::rasterizeTile(Program &geometry, size_t tile)
+    {
+        assert(mBinning);
+        if (tile >= geometry.mBins.size() || geometry.mBins[tile].empty())
+            return;
+
+        // Limit the draw area to the tile, so no other thread will touch these pixels.
+        glm::uvec4 drawArea = mBuffer->getDrawArea();
+        size_t tx = (tile % geometry.mTileNumX) << TILE_SIZE_SHIFT;
+        size_t ty = (tile / geometry.mTileNumX) << TILE_SIZE_SHIFT;
+        mDrawArea = glm::uvec4(glm::max(drawArea[0], uint32_t(tx)), glm::max(drawArea[1], uint32_t(ty)),
+                glm::min(drawArea[2], uint32_t(tx + TILE_SIZE)), glm::min(drawArea[3], uint32_t(ty + TILE_SIZE)));
+        if (mDrawArea[0] >= mDrawArea[2] || mDrawArea[1] >= mDrawArea[3])
+            return;
+
+        setupDraw();
+        for (auto index : geometry.mBins[tile])
+        {
+            TRBinPrim &prim = geometry.mBinPrims[index];
+            VSOutData *vsdata[3];
+            for (int i = 0; i < prim.mNum; i++)
+                vsdata[i] = &geometry.mBinVSOutData[prim.mVertex[i]];
+            mVisibilityId = prim.mId;
+
+            switch (prim.mNum)
+            {
+                case 1: rasterizationPoint(vsdata[0]); break;
+                case 2: rasterizationLine(vsdata); break;
+                case 3:
+                    if (gPolygonMode == TR_LINE)
+                        rasterizationWireframe(vsdata);
+                    else
+                        rasterizationTriangle(vsdata);
+                    break;
+                default: assert(false); break;
+            }
+        }
+    }
+
+    bool Program::testPixel(size_t offset, float depth, bool &shading)
+    {
+        if (gShadingMode == TR_SHADING_DEFERRED)
+        {
+            /* Only one fragment owns the pixel, no depth test and no lock.
+             * Lines of one primitive may overlap, so the depth must match too. */
+            if (mBuffer->getVisibility(offset) != mVisibilityId || mBuffer->getDepth(offset) != depth)
+                return false;
+            mBuffer->updateVisibility(offset, VISIBILITY_NONE);
+            shading = true;
+            return true;
+        }
+
+        /* easy-z */
+        /* Do not use mutex here to speed up, the pixel may be locked by the other thread in atomic buffer mode. */
+        float stored = mBuffer->getDepth(offset);
+        if (gEnableDepthTest && stored != DEPTH_LOCKED && !__depth_test__(depth, stored))
+            return false;
+
+        /* Visibility pass and null fragment stage are shading free. */
+        shading = gShadingMode != TR_SHADING_VISIBILITY && mColorWrite;
+        return true;
+    }
+
+    void Program::writePixel(int x, int y, size_t offset, float depth, float color[], bool shading)
+    {
+        if (gShadingMode == TR_SHADING_DEFERRED)
+        {
+            mBuffer->drawPixel(x, y, color);
             return;
+        }
 
+        // In binning mode every tile is owned by one thread, no lock is needed.
 #if __NEED_BUFFER_LOCK__
-        std::lock_guard<std::mutex> lck(mBuffer->getMutex(offset));
+        std::unique_lock<std::mutex> lck(mBuffer->getMutex(offset), std::defer_lock);
+        if (!mBinning)
+            lck.lock();
+#elif __ATOMIC_BUFFER__
+        if (!mBinning)
+        {
+            float locked = mBuffer->lockDepth(offset);
+            mBuffer->unlockDepth(offset, resolvePixel(x, y, offset, depth, locked, color, shading));
+            return;
+        }
 #endif
+        float stored = mBuffer->getDepth(offset);
+        float result = resolvePixel(x, y, offset, depth, stored, color, shading);
+        if (result != stored)
+            mBuffer->updateDepth(offset, result);
+    }
+
+    float Program::resolvePixel(int x, int y, size_t offset, float depth, float stored, float color[], bool shading)
+    {
         if (gEnableStencilTest && mBuffer->getStencil(offset) != 0)
-            return;
+            return stored;
 
         /* depth test */
-        if (gEnableDepthTest && mBuffer->getDepth(offset) < depth)
-            return;
+        if (gEnableDepthTest && !__depth_test__(depth, stored))
+            return stored;
 
-        mBuffer->updateDepth(offset, depth);
         /* Write stencil buffer need to pass depth test */
         if (gEnableStencilWrite)
             mBuffer->updateStencil(offset, 1);
 
-        mBuffer->drawPixel(x, y, color);
+        if (gShadingMode == TR_SHADING_VISIBILITY)
+            mBuffer->updateVisibility(offset, mVisibilityId);
+        else if (shading)
+            mBuffer->drawPixel(x, y, color);
 #if __DEBUG_FINISH_CB__
         mDrawSth = true;
 #endif
+        return gDepthMask ? depth : stored;
     }
 
     void Program::rasterizationPoint(VSOutData *vsdata)
@@ -377,17 +678,18 @@ namespace TGRenderer
         glm::vec4 clip = vsdata->tr_Position;
         glm::vec4 ndc = clip / clip.w;
         glm::vec2 screen = mBuffer->viewportTransform(ndc);
-        glm::uvec4 drawArea = mBuffer->getDrawArea();
+        glm::uvec4 &drawArea = mDrawArea;
         if (screen.x < drawArea[2] && screen.x >= drawArea[0]
                 && screen.y < drawArea[3] && screen.y >= drawArea[1])
         {
             float depth = ndc.z / 2.0f + 0.5f;
             if (depth < 0.0f)
                 return;
-            prepareFragmentData(&vsdata, 1);
+            (this->*mRaster->mPrepare)(&vsdata, 1);
             mFSInData.mUPC = 0;
             mFSInData.mVPC = 0;
-            drawPixel(screen.x, screen.y, depth);
+            interpolateVaryings(1);
+            (this->*mRaster->mPixel)(screen.x, screen.y, depth);
         }
     }
 
@@ -404,14 +706,14 @@ namespace TGRenderer
             screen[i] = mBuffer->viewportTransform(ndc[i]);
         }
 
-        prepareFragmentData(vsdata, 2);
+        (this->*mRaster->mPrepare)(vsdata, 2);
 
         float x0 = screen[0].x, x1 = screen[1].x;
         float y0 = screen[0].y, y1 = screen[1].y;
         glm::vec2 p0(x0, y0);
         glm::vec2 p1(x1, y1);
         float L = glm::length(p0 - p1);
-        glm::uvec4 drawArea = mBuffer->getDrawArea();
+        glm::uvec4 &drawArea = mDrawArea;
 
         // Bresenham's line algorithm
         bool steep = std::abs(y1 - y0) > std::abs(x1 - x0);
@@ -457,7 +759,8 @@ namespace TGRenderer
                 float LPC = l0 + l1;
                 mFSInData.mUPC = l1 / LPC;
                 mFSInData.mVPC = 0;
-                drawPixel(v.x, v.y, depth);
+                interpolateVaryings(2);
+                (this->*mRaster->mPixel)(v.x, v.y, depth);
             }
 
             error += deltaerr;
@@ -505,51 +808,147 @@ namespace TGRenderer
             /* Special case */
             return;
 
-        prepareFragmentData(vsdata, 3);
-
-        glm::uvec4 drawArea = mBuffer->getDrawArea();
+        glm::uvec4 &drawArea = mDrawArea;
         int xStart = glm::max(float(drawArea[0]), glm::min(glm::min(screen[0].x, screen[1].x), screen[2].x)) + 0.5;
         int yStart = glm::max(float(drawArea[1]), glm::min(glm::min(screen[0].y, screen[1].y), screen[2].y)) + 0.5;
         int xEnd = glm::min(float(drawArea[2] - 1), glm::max(glm::max(screen[0].x, screen[1].x), screen[2].x)) + 1.5;
         int yEnd = glm::min(float(drawArea[3] - 1), glm::max(glm::max(screen[0].y, screen[1].y), screen[2].y)) + 1.5;
+        if (xStart >= xEnd || yStart >= yEnd)
+            return;
 
-        for (int y = yStart; y < yEnd; y++)
+        /* Hi-Z: reject the small triangle before setup if it is behind all of the tiles it touches. */
+        bool depthTest = __early_depth_test__();
+        if (depthTest
+                && ((xEnd - 1) >> HIZ_TILE_SHIFT) - (xStart >> HIZ_TILE_SHIFT) < 2
+                && ((yEnd - 1) >> HIZ_TILE_SHIFT) - (yStart >> HIZ_TILE_SHIFT) < 2)
         {
-            for (int x = xStart; x < xEnd; x++)
+            float minDepth = glm::min(glm::min(ndc[0].z, ndc[1].z), ndc[2].z) * 0.5f + 0.5f;
+            float maxHiZ = 0.0f;
+            for (int y = yStart & ~(HIZ_TILE_SIZE - 1); y < yEnd; y += HIZ_TILE_SIZE)
+                for (int x = xStart & ~(HIZ_TILE_SIZE - 1); x < xEnd; x += HIZ_TILE_SIZE)
+                    maxHiZ = glm::max(maxHiZ, mBuffer->getHiZ(x, y));
+            if (minDepth > maxHiZ)
+                return;
+        }
+
+        (this->*mRaster->mPrepare)(vsdata, 3);
+
+        TRTriangleSetup setup;
+        setupTriangle(setup, screen, clip, ndc, area);
+        setupVaryingPlanes(setup);
+        const TRPlane &z = setup.mDepth;
+
+        /* Hierarchical traversal, test the blocks against the edges and Hi-Z before any per-pixel work. */
+        for (int by = yStart & ~(BLOCK_SIZE - 1); by < yEnd; by += BLOCK_SIZE)
+        {
+            int y0 = glm::max(by, yStart), y1 = glm::min(by + BLOCK_SIZE, yEnd);
+            for (int bx = xStart & ~(BLOCK_SIZE - 1); bx < xEnd; bx += BLOCK_SIZE)
             {
-                glm::vec2 point(x, y);
-                float w0 = __edge__(screen[1], screen[2], point);
-                float w1 = __edge__(screen[2], screen[0], point);
-                float w2 = __edge__(screen[0], screen[1], point);
-                switch (gCullFace)
+                int x0 = glm::max(bx, xStart), x1 = glm::min(bx + BLOCK_SIZE, xEnd);
+                float dx = x0 - setup.mOrigin.x;
+                float dy = y0 - setup.mOrigin.y;
+                float w = x1 - x0 - 1, h = y1 - y0 - 1;
+                bool accept = true, reject = false;
+
+                /* Edge functions are linear, the extremums are at the corners of block. */
+                for (int i = 0; i < 3 && !reject; i++)
                 {
-                    case TR_CW: if (w0 < 0 || w1 < 0 || w2 < 0) continue; break;
-                    case TR_CCW: if (w0 > 0 || w1 > 0 || w2 > 0) continue; break;
-                    default: if (!((w0 > 0 && w1 > 0 && w2 > 0) || (w0 < 0 && w1 < 0 && w2 < 0))) continue; break;
+                    const TRPlane &e = setup.mEdge[i];
+                    float v = e.at(dx, dy);
+                    float vMax = v + glm::max(e.A, 0.0f) * w + glm::max(e.B, 0.0f) * h;
+                    float vMin = v + glm::min(e.A, 0.0f) * w + glm::min(e.B, 0.0f) * h;
+                    if (setup.mInclusive ? vMax < 0 : vMax <= 0)
+                        reject = true;
+                    else if (setup.mInclusive ? vMin < 0 : vMin <= 0)
+                        accept = false;
                 }
+                if (reject)
+                    continue;
+
+                /* So is the depth, the nearest point is behind the farthest pixel of tile. */
+                if (depthTest
+                        && z.at(dx, dy) + glm::min(z.A, 0.0f) * w + glm::min(z.B, 0.0f) * h > mBuffer->getHiZ(bx, by))
+                    continue;
+
+                for (int y = y0; y < y1; y++)
+                    if (!(this->*mRaster->mSpan)(setup, x0, x1, y, !accept))
+                        return;
+
+                /* Depth only goes down, the max depth of tile is still conservative without this.
+                 * But most of the pixels of an accepted block were written, worth to tighten it. */
+                if (accept && depthTest && gDepthMask)
+                    mBuffer->updateHiZ(bx, by);
+            }
+        }
+    }
 
-                /* Barycentric coordinate */
-                w0 /= area;
-                w1 /= area;
-                w2 /= area;
+    void Program::setupTriangle(TRTriangleSetup &setup, glm::vec2 screen[3], glm::vec4 clip[3], glm::vec4 ndc[3], float area)
+    {
+        /* Make the inside of triangle positive for all of the cull modes, then w0 + w1 + w2 = area > 0. */
+        float sign = area > 0 ? 1.0f : -1.0f;
+        float invArea = 1.0f / (area * sign);
+        setup.mInclusive = (gCullFace != TR_NONE);
+        setup.mOrigin = screen[0];
 
-                /* Using the ndc.z to calculate depth, faster then using the interpolated clip.z / clip.w. */
-                float depth = w0 * ndc[0].z + w1 * ndc[1].z + w2 * ndc[2].z;
-                depth = depth / 2.0f + 0.5f;
-                /* z in ndc of opengl should between 0.0f to 1.0f */
-                if (depth < 0.0f)
-                    return;
+        for (int i = 0; i < 3; i++)
+        {
+            glm::vec2 &a = screen[(i + 1) % 3];
+            glm::vec2 &b = screen[(i + 2) % 3];
+            // Same as __edge__(a, b, p)
+            setup.mEdge[i].A = (b.y - a.y) * sign;
+            setup.mEdge[i].B = (a.x - b.x) * sign;
+        }
+        // Evaluated at screen[0]: w0 = area, w1 = w2 = 0.
+        setup.mEdge[0].C = area * sign;
+        setup.mEdge[1].C = 0.0f;
+        setup.mEdge[2].C = 0.0f;
 
-                /* Perspective-Correct */
-                w0 /= clip[0].w;
-                w1 /= clip[1].w;
-                w2 /= clip[2].w;
-                float areaPC = (w0 + w1 + w2);
-                mFSInData.mUPC = w1 / areaPC;
-                mFSInData.mVPC = w2 / areaPC;
-                drawPixel(x, y, depth);
-            }
+        /* Using the ndc.z to calculate depth, faster then using the interpolated clip.z / clip.w. */
+        setup.mDepth.A = setup.mDepth.B = 0.0f;
+        for (int i = 0; i < 3; i++)
+        {
+            float barycentricA = setup.mEdge[i].A * invArea;
+            float barycentricB = setup.mEdge[i].B * invArea;
+            setup.mDepth.A += barycentricA * ndc[i].z * 0.5f;
+            setup.mDepth.B += barycentricB * ndc[i].z * 0.5f;
+            setup.mPC[i].A = barycentricA / clip[i].w;
+            setup.mPC[i].B = barycentricB / clip[i].w;
+            setup.mPC[i].C = 0.0f;
+        }
+        setup.mDepth.C = ndc[0].z * 0.5f + 0.5f;
+        setup.mPC[0].C = 1.0f / clip[0].w;
+    }
+
+    void Program::setupVaryingPlanes(const TRTriangleSetup &setup)
+    {
+        /* varying / w = V0 * (PC0 + PC1 + PC2) + (V1 - V0) * PC1 + (V2 - V0) * PC2, linear in screen space. */
+        const TRPlane &pc0 = setup.mPC[0], &pc1 = setup.mPC[1], &pc2 = setup.mPC[2];
+        float sumA = pc0.A + pc1.A + pc2.A, sumB = pc0.B + pc1.B + pc2.B, sumC = pc0.C + pc1.C + pc2.C;
+        for (size_t i = 0; i < mLayout->mSize; i++)
+        {
+            float v0 = mFSInData.mVaryingPrim[0][i];
+            float v1 = mFSInData.mVaryingPrim[1][i];
+            float v2 = mFSInData.mVaryingPrim[2][i];
+            mVaryingPlanes.mA[i] = v0 * sumA + v1 * pc1.A + v2 * pc2.A;
+            mVaryingPlanes.mB[i] = v0 * sumB + v1 * pc1.B + v2 * pc2.B;
+            mVaryingPlanes.mC[i] = v0 * sumC + v1 * pc1.C + v2 * pc2.C;
         }
+        mVaryingPlanes.mInvWA = sumA;
+        mVaryingPlanes.mInvWB = sumB;
+        mFSInData.mPlanes = &mVaryingPlanes;
+    }
+
+    void Program::interpolateVaryings(int num)
+    {
+        for (size_t i = 0; i < mLayout->mSize; i++)
+        {
+            float v = mFSInData.mVaryingPrim[0][i];
+            if (num > 1)
+                v += mFSInData.mVaryingPrim[1][i] * mFSInData.mUPC;
+            mFSInData.mVarying[i] = v;
+        }
+        mFSInData.mW = 1.0f;
+        mFSInData.mPlanes = nullptr;
     }
 
     void trPrimsInstanced(TRMeshData &mesh, Shader *shader, size_t index, size_t num)
@@ -559,36 +958,221 @@ namespace TGRenderer
         gProgram.drawPrimsInstranced(mesh, index, num);
     }
 
-    void trPrimsMT(TRMeshData &mesh, Shader *shader)
+    void trBinPrimsInstanced(size_t id, TRMeshData &mesh, Shader *shader, size_t index, size_t num)
+    {
+        gBinProgram[id].enableBinning(true);
+        gBinProgram[id].setBuffer(gRenderTarget);
+        gBinProgram[id].setShader(shader);
+        gBinProgram[id].binPrimsInstanced(mesh, index, num);
+    }
+
+    void trRasterizeTiles(size_t id, Shader *shader, size_t geometryNum)
+    {
+        // This program may have got nothing in geometry stage, set the states again.
+        gBinProgram[id].enableBinning(true);
+        gBinProgram[id].setBuffer(gRenderTarget);
+        gBinProgram[id].setShader(shader);
+
+        size_t tileNum = ((gRenderTarget->getW() + TILE_SIZE - 1) >> TILE_SIZE_SHIFT)
+            * ((gRenderTarget->getH() + TILE_SIZE - 1) >> TILE_SIZE_SHIFT);
+
+        // Tiles are picked dynamically for load balance, primitive order is kept inside one tile.
+        for (size_t tile = gNextTile++; tile < tileNum; tile = gNextTile++)
+            for (size_t i = 0; i < geometryNum; i++)
+                gBinProgram[id].rasterizeTile(gBinProgram[i], tile);
+    }
+
+    /* Split the primitives between threadNum threads, return false if this thread has nothing to do. */
+    static inline bool __get_prims_slice__(size_t id, size_t threadNum, size_t primsCount, size_t &start, size_t &num)
+    {
+        size_t index_step = primsCount / threadNum;
+        if (!index_step)
+            index_step = 1;
+
+        start = id * index_step;
+        if (start > primsCount - 1)
+            return false;
+        num = (id == threadNum - 1) ? primsCount - start : index_step;
+        return true;
+    }
+
+    void trParallelFor(size_t count, const std::function<void(size_t start, size_t num)> &job)
+    {
+        if (!count)
+            return;
+        if (gJobThreadPool.getThreadNum() == 1)
+            gJobThreadPool.setThreadNum(std::min(size_t(std::thread::hardware_concurrency()), size_t(THREAD_MAX)));
+        size_t threadNum = gJobThreadPool.getThreadNum();
+        gJobThreadPool.run([&](size_t id)
+        {
+            size_t start, num;
+            if (__get_prims_slice__(id, threadNum, count, start, num))
+                job(start, num);
+        });
+    }
+
+    void trPrimsBinning(TRMeshData &mesh, Shader *shader)
     {
-        size_t primsCount = mesh.vertices.size() / gDrawMode;
-        if (gThreadNum > 1)
+        size_t primsCount = __get_prims_count__(mesh);
+        if (!primsCount)
+            return;
+
+        // Geometry stage: split the primitives.
+        size_t threadNum = gThreadPool.getThreadNum();
+        size_t geometryNum = std::min(threadNum, primsCount);
+        gThreadPool.run([&](size_t id)
+        {
+            size_t start, num;
+            if (__get_prims_slice__(id, threadNum, primsCount, start, num))
+                trBinPrimsInstanced(id, mesh, shader, start, num);
+        });
+
+        // Raster stage: split the tiles.
+        gNextTile = 0;
+        gThreadPool.run([&](size_t id)
         {
-            std::vector<std::thread> thread_pool;
-            size_t index_step = primsCount / gThreadNum;
-            if (!index_step)
-                index_step = 1;
+            trRasterizeTiles(id, shader, geometryNum);
+        });
+    }
+
+    static inline bool __is_batch_reusable__(TRVertexBatch &batch, TRMeshData &mesh, Shader *shader)
+    {
+        if (batch.mMesh != &mesh || batch.mShader != shader || batch.mVertexNum != mesh.vertices.size() || batch.mUniform != gUniform)
+            return false;
+        for (int i = 0; i < MAT_INDEX_MAX; i++)
+            if (batch.mMat4[i] != gMat4[i] || batch.mMat3[i] != gMat3[i])
+                return false;
+        for (int i = 0; i < TEXTURE_INDEX_MAX; i++)
+            if (batch.mTexture[i] != gTexture[i])
+                return false;
+        return true;
+    }
+
+    void Program::shadeVertices(size_t id, TRVertexBatch &batch, TRMeshData &mesh, Shader *shader)
+    {
+        size_t start, num;
+        if (!__get_prims_slice__(id, gThreadPool.getThreadNum(), batch.mVertexNum, start, num))
+            return;
+
+        const TRVaryingLayout *layout = &shader->getVaryingLayout();
+        for (size_t i = start; i < start + num; i++)
+        {
+            batch.mVSOutData[i].mLayout = layout;
+            batch.mVSOutData[i].mVarying = batch.mVarying.data() + i * layout->mSize;
+            shader->vertex(mesh, &batch.mVSOutData[i], i);
+            glm::vec4 &pos = batch.mVSOutData[i].tr_Position;
+            batch.mX[i] = pos.x;
+            batch.mY[i] = pos.y;
+            batch.mW[i] = pos.w;
+        }
+
+        // Branch free, easy to be vectorized.
+        const float *x = batch.mX.data(), *y = batch.mY.data(), *w = batch.mW.data();
+        uint8_t *outcode = batch.mOutcode.data();
+        for (size_t i = start; i < start + num; i++)
+            outcode[i] = (x[i] < -w[i]) * OUTCODE_LEFT | (x[i] > w[i]) * OUTCODE_RIGHT
+                | (y[i] < -w[i]) * OUTCODE_BOTTOM | (y[i] > w[i]) * OUTCODE_TOP
+                | (w[i] < W_CLIPPING_PLANE) * OUTCODE_W;
+    }
 
-            for (size_t i = 0; i < gThreadNum; i++)
+    /* Run the vertex shader over the whole mesh in parallel, or pick up the results of the same draw if reuse is enabled. */
+    TRVertexBatch *trVertexStage(TRMeshData &mesh, Shader *shader)
+    {
+        gVertexBatchTick++;
+        for (auto &batch : gVertexBatches)
+            if (__is_batch_reusable__(batch, mesh, shader))
             {
-                size_t start = i * index_step;
-                if (start > primsCount - 1)
-                    break;
-                if (i == gThreadNum - 1)
-                    index_step = primsCount - start;
+                batch.mLastUse = gVertexBatchTick;
+                return &batch;
+            }
 
-                thread_pool.push_back(std::thread(trPrimsInstanced, std::ref(mesh), shader, start, index_step));
+        size_t slot = 0;
+        if (gEnableVertexReuse)
+        {
+            if (gVertexBatches.size() <= size_t(VERTEX_REUSE_MAX))
+            {
+                gVertexBatches.emplace_back();
+                slot = gVertexBatches.size() - 1;
+            }
+            else
+            {
+                // Replace the least recently used one, the storage of its vectors is kept.
+                slot = 1;
+                for (size_t i = 2; i < gVertexBatches.size(); i++)
+                    if (gVertexBatches[i].mLastUse < gVertexBatches[slot].mLastUse)
+                        slot = i;
             }
+        }
+        TRVertexBatch &batch = gVertexBatches[slot];
+        batch.mLastUse = gVertexBatchTick;
+        batch.mMesh = &mesh;
+        batch.mShader = shader;
+        batch.mVertexNum = mesh.vertices.size();
+        std::copy(gMat4, gMat4 + MAT_INDEX_MAX, batch.mMat4);
+        std::copy(gMat3, gMat3 + MAT_INDEX_MAX, batch.mMat3);
+        std::copy(gTexture, gTexture + TEXTURE_INDEX_MAX, batch.mTexture);
+        batch.mUniform = gUniform;
+
+        batch.mVSOutData.resize(batch.mVertexNum);
+        batch.mVarying.resize(batch.mVertexNum * shader->getVaryingLayout().mSize);
+        batch.mX.resize(batch.mVertexNum);
+        batch.mY.resize(batch.mVertexNum);
+        batch.mW.resize(batch.mVertexNum);
+        batch.mOutcode.resize(batch.mVertexNum);
+        gThreadPool.run([&](size_t id)
+        {
+            Program::shadeVertices(id, batch, mesh, shader);
+        });
 
-            for (auto &th : thread_pool)
-                if (th.joinable())
-                    th.join();
+        // The scratch batch is overwritten by the next draw, don't let the key match by chance.
+        if (!gEnableVertexReuse)
+            batch.mMesh = nullptr;
+        return &batch;
+    }
 
+    void trPrimsMT(TRMeshData &mesh, Shader *shader)
+    {
+        size_t primsCount = __get_prims_count__(mesh);
+        if (!primsCount)
+            return;
+
+        gThreadPool.setThreadNum(gThreadNum);
+        gVertexBatch = (gEnableVertexBatch || gEnableVertexReuse) ? trVertexStage(mesh, shader) : nullptr;
+        if (gEnableBinning)
+        {
+            trPrimsBinning(mesh, shader);
+            return;
         }
-        else
+
+        size_t threadNum = gThreadPool.getThreadNum();
+        gThreadPool.run([&](size_t id)
+        {
+            size_t start, num;
+            if (__get_prims_slice__(id, threadNum, primsCount, start, num))
+                trPrimsInstanced(mesh, shader, start, num);
+        });
+    }
+
+    void trDrawPrims(TRDrawMode mode, TRMeshData &mesh, Shader *shader, bool indexed, const TRRasterFuncs &raster)
+    {
+        __compute_premultiply_mat__();
+
+        gDrawMode = mode;
+        gDrawIndexed = indexed;
+        gRaster = &raster;
+        gLayout = &shader->getVaryingLayout();
+        gFragmentBatch = shader->hasFragmentBatch();
+        if (gShadingMode != TR_SHADING_FORWARD)
         {
-            trPrimsInstanced(mesh, shader, 0, primsCount);
+            gDrawId = gDrawNum++;
+            if (gShadingMode == TR_SHADING_VISIBILITY)
+                gVisiblePrims.emplace_back(__get_prims_count__(mesh), false);
         }
+        trPrimsMT(mesh, shader);
+
+        /* Depth may go up without depth test or with the other functions, Hi-Z is not conservative anymore. */
+        if (gDepthMask && gShadingMode != TR_SHADING_DEFERRED && !__early_depth_test__())
+            gRenderTarget->rebuildHiZ();
     }
 
     // Matrix related API
@@ -635,18 +1219,19 @@ namespace TGRenderer
     // Draw related API
     void trDrawArrays(TRDrawMode mode, TRMeshData &mesh, Shader *shader)
     {
-        __compute_premultiply_mat__();
+        trDrawPrims(mode, mesh, shader, false, trGetRasterFuncs<Shader>());
+    }
 
-        gDrawMode = mode;
-        trPrimsMT(mesh, shader);
+    void trDrawElements(TRDrawMode mode, TRMeshData &mesh, Shader *shader)
+    {
+        trDrawPrims(mode, mesh, shader, true, trGetRasterFuncs<Shader>());
     }
 
     // Core state related API
     void trSetRenderThreadNum(size_t num)
     {
-        gThreadNum = num;
-        if (gThreadNum > THREAD_MAX)
-            gThreadNum = THREAD_MAX;
+        // The primitives are split by gThreadNum, 0 means the caller thread only.
+        gThreadNum = std::min(std::max(num, size_t(1)), size_t(THREAD_MAX));
     }
 
     void trEnableStencilTest(bool enable)
@@ -659,11 +1244,43 @@ namespace TGRenderer
         gEnableStencilWrite = enable;
     }
 
+    void trEnableBinning(bool enable)
+    {
+        gEnableBinning = enable;
+    }
+
+    void trEnableVertexBatch(bool enable)
+    {
+        gEnableVertexBatch = enable;
+    }
+
+    void trEnableVertexReuse(bool enable)
+    {
+        gEnableVertexReuse = enable;
+        if (!enable)
+            gVertexBatches.resize(1);
+    }
+
     void trEnableDepthTest(bool enable)
     {
         gEnableDepthTest = enable;
     }
 
+    void trDepthFunc(TRDepthFunc func)
+    {
+        gDepthFunc = func;
+    }
+
+    void trDepthMask(bool enable)
+    {
+        gDepthMask = enable;
+    }
+
+    void trEnableColorWrite(bool enable)
+    {
+        gEnableColorWrite = enable;
+    }
+
     void trPolygonMode(TRPolygonMode mode)
     {
         gPolygonMode = mode;
@@ -674,6 +1291,28 @@ namespace TGRenderer
         gCullFace = mode;
     }
 
+    void trShadingMode(TRShadingMode mode)
+    {
+        gShadingMode = mode;
+        gDrawNum = 0;
+        if (mode == TR_SHADING_VISIBILITY)
+        {
+            gVisiblePrims.clear();
+            gRenderTarget->clearVisibility();
+        }
+        else if (mode == TR_SHADING_DEFERRED)
+        {
+            // Mark the primitives which own any pixel, the others can be skipped in the deferred pass.
+            const uint64_t *visibility = gRenderTarget->getVisibilityBuffer();
+            for (size_t i = 0; visibility && i < gRenderTarget->getW() * gRenderTarget->getH(); i++)
+            {
+                size_t draw = visibility[i] >> 32, prim = visibility[i] & 0xffffffff;
+                if (visibility[i] != VISIBILITY_NONE && draw < gVisiblePrims.size() && prim < gVisiblePrims[draw].size())
+                    gVisiblePrims[draw][prim] = true;
+            }
+        }
+    }
+
     TRCullFaceMode trGetCullFaceMode()
     {
         return gCullFace;
@@ -737,6 +1376,20 @@ namespace TGRenderer
             return nullptr;
     }
 
+    void trBindSampler(TRSampler *sampler, int type)
+    {
+        if (type < TEXTURE_INDEX_MAX)
+            gSampler[type] = sampler;
+    }
+
+    TRSampler *trGetSampler(int type)
+    {
+        if (type < TEXTURE_INDEX_MAX && gSampler[type] != nullptr)
+            return gSampler[type];
+        else
+            return &gDefaultSampler;
+    }
+
     // Uniform data related API
     void trSetUniformData(void *data)
     {
@@ -3,6 +3,8 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <map>
+#include <tuple>
 #include <chrono>
 #include <glm/ext.hpp>
 
@@ -71,7 +73,8 @@ bool truLoadObj(
         const char * path,
         std::vector<glm::vec3> & out_vertices,
         std::vector<glm::vec2> & out_texcoords,
-        std::vector<glm::vec3> & out_normals
+        std::vector<glm::vec3> & out_normals,
+        std::vector<uint32_t> & out_indices
         )
 {
     std::cout << "Loading OBJ file " << path << "..." << std::endl;
@@ -86,6 +89,7 @@ bool truLoadObj(
     std::vector<glm::vec3> temp_vertices;
     std::vector<glm::vec2> temp_texcoords;
     std::vector<glm::vec3> temp_normals;
+    std::map<std::tuple<unsigned int, unsigned int, unsigned int>, uint32_t> vertexMap;
     int faces = 0;
 
     while(true)
@@ -147,12 +151,26 @@ bool truLoadObj(
         unsigned int uvIndex        = uvIndices[i];
         unsigned int normalIndex    = normalIndices[i];
 
+        // Same attributes, same vertex
+        auto key = std::make_tuple(vertexIndex, uvIndex, normalIndex);
+        auto it = vertexMap.find(key);
+        if (it != vertexMap.end())
+        {
+            out_indices.push_back(it->second);
+            continue;
+        }
+        if (vertexIndex - 1 >= temp_vertices.size() || uvIndex - 1 >= temp_texcoords.size() || normalIndex - 1 >= temp_normals.size())
+            goto error_return;
+
         // Get the attributes thanks to the index
         glm::vec3 vertex    = temp_vertices[vertexIndex-1];
         glm::vec2 uv        = temp_texcoords[uvIndex-1];
         glm::vec3 normal    = temp_normals[normalIndex-1];
 
         // Put the attributes in buffers
+        uint32_t index = out_vertices.size();
+        vertexMap[key] = index;
+        out_indices     .push_back(index);
         out_vertices    .push_back(vertex);
         out_texcoords   .push_back(uv);
         out_normals     .push_back(normal);
@@ -166,6 +184,30 @@ error_return:
     return false;
 }
 
+bool truLoadObj(
+        const char * path,
+        std::vector<glm::vec3> & out_vertices,
+        std::vector<glm::vec2> & out_texcoords,
+        std::vector<glm::vec3> & out_normals
+        )
+{
+    std::vector<glm::vec3> vertices;
+    std::vector<glm::vec2> texcoords;
+    std::vector<glm::vec3> normals;
+    std::vector<uint32_t> indices;
+
+    if (!truLoadObj(path, vertices, texcoords, normals, indices))
+        return false;
+
+    for (auto index : indices)
+    {
+        out_vertices    .push_back(vertices[index]);
+        out_texcoords   .push_back(texcoords[index]);
+        out_normals     .push_back(normals[index]);
+    }
+    return true;
+}
+
 void truCreateFloorPlane(TGRenderer::TRMeshData &mesh, float height, float width, const float *color)
 {
     /* Workaroud: in line mode, wrap texture coord may cause a strage bug, 2.0 will be treat as 0.0 not 1.0 */
@@ -6,6 +6,7 @@
 #include "trapi.hpp"
 #include "utils.hpp"
 #include "objs.hpp"
+#include "trspecialize.hpp"
 
 using namespace std;
 using namespace TGRenderer;
@@ -67,7 +68,7 @@ TRObj::TRObj(const char *config)
         if (type == "obj")
         {
             cout << "Loading OBJ..." << endl;
-            if (!truLoadObj(ss.str().c_str(), mMeshData.vertices, mMeshData.texcoords, mMeshData.normals))
+            if (!truLoadObj(ss.str().c_str(), mMeshData.vertices, mMeshData.texcoords, mMeshData.normals, mMeshData.indices))
             {
                 cout << "Load OBJ file error!" << endl;
                 goto close_file;
@@ -75,7 +76,7 @@ TRObj::TRObj(const char *config)
 
             if (mMeshData.vertices.size() != mMeshData.texcoords.size()
                     || mMeshData.vertices.size() != mMeshData.normals.size()
-                    || mMeshData.vertices.size() % 3 != 0)
+                    || mMeshData.indices.size() % 3 != 0)
             {
                 cout << "Mesh data is invalid." << endl;
                 goto close_file;
@@ -148,7 +149,13 @@ bool TRObj::draw(int id)
     data->mShininess = int(mAttribute.Ns);
     data->mSpecularStrength = mAttribute.sharpness / 1000.f;
 
-    trDrawArrays(TR_TRIANGLES, mMeshData, mShaders[id]);
+    switch (id)
+    {
+        case 0: trDrawElements<ColorShader>(TR_TRIANGLES, mMeshData, &mColorShader); break;
+        case 1: trDrawElements<TextureMapShader>(TR_TRIANGLES, mMeshData, &mTextureMapShader); break;
+        case 2: trDrawElements<ColorPhongShader>(TR_TRIANGLES, mMeshData, &mColorPhongShader); break;
+        default: trDrawElements<TextureMapPhongShader>(TR_TRIANGLES, mMeshData, &mTextureMapPhongShader); break;
+    }
 
     *data = sdata;
     return true;
@@ -160,7 +167,7 @@ bool TRObj::drawShadowMap()
         return false;
     TRCullFaceMode oldCullFaceMode = trGetCullFaceMode();
     trCullFaceMode(TR_NONE);
-    trDrawArrays(TR_TRIANGLES, mMeshData, &mShadowShader);
+    trDrawElements<ShadowMapShader>(TR_TRIANGLES, mMeshData, &mShadowShader);
     trCullFaceMode(oldCullFaceMode);
     return true;
 }
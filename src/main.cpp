@@ -10,12 +10,20 @@
 #include "utils.hpp"
 #include "program.hpp"
 #include "skybox.hpp"
+#include "shadow.hpp"
+#include "trspecialize.hpp"
 
 #define WIDTH (1280)
 #define HEIGHT (720)
 
-#define TWIDTH (1024)
-#define THEIGHT (1024)
+/* Cascades of the shadow map, fitted to the view frustum up to SHADOW_DISTANCE. */
+#define CASCADE_SIZE (512)
+#define CASCADE_NUM (3)
+#define SHADOW_DISTANCE (10.0f)
+
+#define FOVY (75.0f)
+#define Z_NEAR (0.1f)
+#define Z_FAR (100.0f)
 
 #define ENABLE_SHADOW 1
 #define DRAW_FLOOR 1
@@ -47,8 +55,13 @@ class Option
         int ProgramId = 3;
         bool enableSkybox = false;
         bool enableShadow = false;
+        bool varianceShadow = false;
         bool drawFloor = false;
         bool wireframeMode = false;
+        bool binning = false;
+        bool visibility = false;
+        bool depthPrepass = false;
+        bool vertexBatch = false;
         bool rotateModel = false;
         bool rotateEye = false;
         bool rotateLight = false;
@@ -83,6 +96,13 @@ void kcb(int key)
         case SDL_SCANCODE_S:
             gOption.enableShadow = !gOption.enableShadow;
             break;
+#if ENABLE_SHADOW
+        case SDL_SCANCODE_P:
+            gOption.varianceShadow = !gOption.varianceShadow;
+            // The moments are built with the shadow map.
+            gNeedRedrawShadowMap = true;
+            break;
+#endif
         case SDL_SCANCODE_F:
             gOption.drawFloor = !gOption.drawFloor;
             break;
@@ -93,6 +113,22 @@ void kcb(int key)
             else
                 trPolygonMode(TR_FILL);
             break;
+        case SDL_SCANCODE_T:
+            gOption.binning = !gOption.binning;
+            trEnableBinning(gOption.binning);
+            break;
+        case SDL_SCANCODE_V:
+            gOption.visibility = !gOption.visibility;
+            gOption.depthPrepass = false;
+            break;
+        case SDL_SCANCODE_G:
+            gOption.vertexBatch = !gOption.vertexBatch;
+            trEnableVertexBatch(gOption.vertexBatch);
+            break;
+        case SDL_SCANCODE_Z:
+            gOption.depthPrepass = !gOption.depthPrepass;
+            gOption.visibility = false;
+            break;
         case SDL_SCANCODE_M:
             gOption.rotateModel = !gOption.rotateModel;
             // avoid chaos
@@ -193,6 +229,10 @@ void reCalcMat(glm::mat4 &modelMat, glm::mat4 &eyeViewMat
 
     if (reCalcViewMat)
     {
+#if ENABLE_SHADOW
+        // The cascades follow the camera.
+        gNeedRedrawShadowMap = true;
+#endif
         float degree = glm::radians(1.0f * rotateE);
         eyeViewMat = glm::lookAt(
                 glm::vec3(gView.distanceInXZPlane * glm::sin(degree), gView.Y, gView.distanceInXZPlane * glm::cos(degree)),
@@ -235,10 +275,20 @@ void dumpInfo()
         std::cout << "skybox ";
     if (gOption.enableShadow)
         std::cout << "shadow ";
+    if (gOption.varianceShadow)
+        std::cout << "variance-shadow ";
     if (gOption.drawFloor)
         std::cout << "floor ";
     if (gOption.wireframeMode)
         std::cout << "wireframe ";
+    if (gOption.binning)
+        std::cout << "binning ";
+    if (gOption.visibility)
+        std::cout << "visibility ";
+    if (gOption.depthPrepass)
+        std::cout << "depth-prepass ";
+    if (gOption.vertexBatch)
+        std::cout << "vertex-batch ";
     if (gOption.rotateModel)
         std::cout << "model-rotate ";
     if (gOption.rotateEye)
@@ -262,8 +312,9 @@ int main(int argc, char *argv[])
     w.registerKeyEventCb(kcb);
 
 #if ENABLE_SHADOW
-    TRBuffer *windowBuffer = trGetRenderTarget();
-    TRTextureBuffer *shadowBuffer = new TRTextureBuffer(TWIDTH, THEIGHT);
+    TRCascadedShadowMap *shadowMap = new TRCascadedShadowMap(CASCADE_SIZE, CASCADE_NUM);
+    TRVarianceShadowMap *varianceShadowMap = new TRVarianceShadowMap(CASCADE_SIZE * CASCADE_NUM, CASCADE_SIZE);
+    unidata.mShadowCascades = shadowMap;
 #endif
 
     std::vector<std::shared_ptr <TRObj>> objs;
@@ -283,19 +334,13 @@ int main(int argc, char *argv[])
             glm::vec3(0,1,0));  // Head is up (set to 0,-1,0 to look upside-down)
 
     // Projection matrix : xx Field of View, w:h ratio, display range : 0.1 unit <-> 100 units
-    glm::mat4 eyeProjMat = glm::perspective(glm::radians(75.0f), (float)WIDTH / (float)HEIGHT, 0.1f, 100.0f);
+    glm::mat4 eyeProjMat = glm::perspective(glm::radians(FOVY), (float)WIDTH / (float)HEIGHT, Z_NEAR, Z_FAR);
 
 #if ENABLE_SHADOW
     glm::mat4 lightViewMat = glm::lookAt(
             glm::vec3(0,1,1),
             glm::vec3(0,0,0),
             glm::vec3(0,1,0));
-
-    glm::mat4 lightProjMat = glm::ortho(-2.0f, 2.0f, -2.0f, 2.0f, 0.1f, 100.0f);
-
-    trSetRenderTarget(shadowBuffer);
-    trClearColor3f(1, 1, 1);
-    trSetRenderTarget(windowBuffer);
 #endif
 
 #if DRAW_FLOOR
@@ -337,63 +382,84 @@ int main(int argc, char *argv[])
         if (gOption.enableShadow && gNeedRedrawShadowMap)
         {
             gNeedRedrawShadowMap = false;
-            // Get window buffer again since we enable resize event
-            windowBuffer = trGetRenderTarget();
-            trSetRenderTarget(shadowBuffer);
-            trClear(TR_CLEAR_DEPTH_BIT | TR_CLEAR_COLOR_BIT);
+            shadowMap->fit(eyeViewMat, glm::radians(FOVY), (float)WIDTH / (float)HEIGHT, Z_NEAR, SHADOW_DISTANCE, lightViewMat);
             trSetMat4(modelMat, MAT4_MODEL);
-            trSetMat4(lightViewMat, MAT4_VIEW);
-            trSetMat4(lightProjMat, MAT4_PROJ);
-            for (auto obj : objs)
-                obj->drawShadowMap();
-            /* Skip floor in shadow map to speedup */
-
-            trSetRenderTarget(windowBuffer);
-        }
-        if (gOption.enableShadow)
-        {
-            // We must reset the light mvp here
-            trSetMat4(lightProjMat * lightViewMat * modelMat, MAT4_LIGHT_MVP);
-            trBindTexture(shadowBuffer->getTexture(), TEXTURE_SHADOWMAP);
+            shadowMap->draw([&]()
+            {
+                for (auto obj : objs)
+                    obj->drawShadowMap();
+                /* Skip floor in shadow map to speedup */
+            });
+            // Filter once per shadow map update instead of per pixel.
+            if (gOption.varianceShadow)
+                varianceShadowMap->update(shadowMap->getTexture());
         }
+        TRTexture *shadowTexture = gOption.varianceShadow ? varianceShadowMap->getTexture() : shadowMap->getTexture();
 #endif
         // do clear color again since we enable resize event
         trClearColor3f(0.1, 0.1, 0.1);
         trClear(TR_CLEAR_DEPTH_BIT | TR_CLEAR_COLOR_BIT);
-        trSetMat4(modelMat, MAT4_MODEL);
-        trSetMat4(eyeViewMat, MAT4_VIEW);
-        trSetMat4(eyeProjMat, MAT4_PROJ);
-        for (auto obj : objs)
-            obj->draw(gOption.ProgramId);
-
-#if DRAW_FLOOR
-        if (gOption.drawFloor)
+        // Visibility and depth pre-pass mode: the same draws twice, the second pass only shades the visible pixels.
+        int passNum = (gOption.visibility || gOption.depthPrepass) ? 2 : 1;
+        // The second pass has the same vertices.
+        trEnableVertexReuse(passNum > 1);
+        for (int pass = 0; pass < passNum; pass++)
         {
-            trUnbindTextureAll();
+            if (gOption.visibility)
+                trShadingMode(pass == 0 ? TR_SHADING_VISIBILITY : TR_SHADING_DEFERRED);
+            if (gOption.depthPrepass)
+            {
+                trEnableColorWrite(pass != 0);
+                trDepthFunc(pass == 0 ? TR_LEQUAL : TR_EQUAL);
+                trDepthMask(pass == 0);
+            }
 #if ENABLE_SHADOW
             if (gOption.enableShadow)
             {
-                trSetMat4(lightProjMat * lightViewMat, MAT4_LIGHT_MVP);
-                trBindTexture(shadowBuffer->getTexture(), TEXTURE_SHADOWMAP);
+                // We must reset the light mvp here
+                trSetMat4(shadowMap->getLightMat() * modelMat, MAT4_LIGHT_MVP);
+                trBindTexture(shadowTexture, TEXTURE_SHADOWMAP);
             }
 #endif
-            trSetMat4(glm::mat4(1.0f), MAT4_MODEL);
-            trBindTexture(&floorTex, TEXTURE_DIFFUSE);
-            trDrawArrays(TR_TRIANGLES, floorMesh, &floorShader);
-        }
+            trSetMat4(modelMat, MAT4_MODEL);
+            trSetMat4(eyeViewMat, MAT4_VIEW);
+            trSetMat4(eyeProjMat, MAT4_PROJ);
+            for (auto obj : objs)
+                obj->draw(gOption.ProgramId);
+
+#if DRAW_FLOOR
+            if (gOption.drawFloor)
+            {
+                trUnbindTextureAll();
+#if ENABLE_SHADOW
+                if (gOption.enableShadow)
+                {
+                    trSetMat4(shadowMap->getLightMat(), MAT4_LIGHT_MVP);
+                    trBindTexture(shadowTexture, TEXTURE_SHADOWMAP);
+                }
+#endif
+                trSetMat4(glm::mat4(1.0f), MAT4_MODEL);
+                trBindTexture(&floorTex, TEXTURE_DIFFUSE);
+                trDrawArrays<TextureMapPhongShader>(TR_TRIANGLES, floorMesh, &floorShader);
+            }
 #endif
 #if ENABLE_SHADOW
-        if (gOption.enableShadow)
-            trBindTexture(nullptr, TEXTURE_SHADOWMAP);
+            if (gOption.enableShadow)
+                trBindTexture(nullptr, TEXTURE_SHADOWMAP);
 #endif
 #if ENABLE_SKYBOX
-        if (gOption.enableSkybox)
-        {
-            if (!pSkybox)
-                pSkybox = new TRSkyBox(gCubeTextureNames);
-            pSkybox->draw();
-        }
+            if (gOption.enableSkybox)
+            {
+                if (!pSkybox)
+                    pSkybox = new TRSkyBox(gCubeTextureNames);
+                pSkybox->draw();
+            }
 #endif
+        }
+        trEnableVertexReuse(false);
+        trShadingMode(TR_SHADING_FORWARD);
+        trDepthFunc(TR_LEQUAL);
+        trDepthMask(true);
         w.swapBuffer();
 
         double current = truTimerGetSecondsFromClick();
@@ -416,7 +482,8 @@ int main(int argc, char *argv[])
         delete pSkybox;
 #endif
 #if ENABLE_SHADOW
-    delete shadowBuffer;
+    delete varianceShadowMap;
+    delete shadowMap;
 #endif
     return 0;
 }